@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "trs20.h"
+
+#define BENCH_SIZE              (16 * 1024 * 1024)
+#define BENCH_SECONDS           0.5
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t reference(uint16_t crc, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        crc = crc16(crc, data[i]);
+    }
+    return crc;
+}
+
+int main(int argc, const char * argv[])
+{
+    uint8_t *data = malloc(BENCH_SIZE);
+    if (!data) {
+        perror("malloc");
+        return 1;
+    }
+    srandom(20);
+    for (size_t i = 0; i < BENCH_SIZE; i++) {
+        data[i] = random();
+    }
+
+    const crc_engine *engines;
+    int count = crc_engines(&engines);
+
+    // every engine has to agree with crc16() for all lengths, offsets and seeds before it gets timed
+    int failed = 0;
+    for (int e = 0; e < count; e++) {
+        for (size_t size = 0; size < 300 && !failed; size++) {
+            for (size_t offset = 0; offset < 16; offset++) {
+                uint16_t seed = random();
+                if (engines[e].update(seed, data + offset, size) != reference(seed, data + offset, size)) {
+                    fprintf(stderr, "%s: mismatch at size %zu offset %zu\n", engines[e].name, size, offset);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        if (engines[e].update(0, data, BENCH_SIZE) != reference(0, data, BENCH_SIZE)) {
+            fprintf(stderr, "%s: mismatch over %d bytes\n", engines[e].name, BENCH_SIZE);
+            failed = 1;
+        }
+    }
+
+    // ZModem's CRC-32, against the check value and a bit at a time
+    uint32_t check = crc32(0, (const uint8_t *)"123456789", 9);
+    if (check != 0xcbf43926) {
+        fprintf(stderr, "crc32: check value %08x\n", check);
+        failed = 1;
+    }
+    for (size_t size = 0; size < 300 && !failed; size++) {
+        uint32_t r = 0xffffffff;
+        for (size_t i = 0; i < size; i++) {
+            r ^= data[i];
+            for (int bit = 0; bit < 8; bit++) r = r & 1 ? (r >> 1) ^ 0xedb88320 : r >> 1;
+        }
+        if (crc32(crc32(0, data, size / 3), data + size / 3, size - size / 3) != ~r) {
+            fprintf(stderr, "crc32: mismatch at size %zu\n", size);
+            failed = 1;
+        }
+    }
+    if (failed) return 1;
+
+    for (int e = 0; e < count; e++) {
+        volatile uint16_t sink = 0;
+        size_t bytes = 0;
+        double start = now(), elapsed;
+        do {
+            sink ^= engines[e].update(0, data, BENCH_SIZE);
+            bytes += BENCH_SIZE;
+        } while ((elapsed = now() - start) < BENCH_SECONDS);
+        printf("%-8s %10.1f MB/s%s\n", engines[e].name, bytes / elapsed / 1e6, e == count - 1 ? "  (selected)" : "");
+    }
+
+    volatile uint32_t sink32 = 0;
+    size_t bytes = 0;
+    double start = now(), elapsed;
+    do {
+        sink32 ^= crc32(0, data, BENCH_SIZE);
+        bytes += BENCH_SIZE;
+    } while ((elapsed = now() - start) < BENCH_SECONDS);
+    printf("%-8s %10.1f MB/s\n", "crc32", bytes / elapsed / 1e6);
+
+    free(data);
+    return 0;
+}
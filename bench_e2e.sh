@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# End-to-end transfer benchmark: runs scomm against trs20sim for the patch
+# upload, each YModem flavour and ZModem, on a clean line and a lossy one, and
+# prints the time and throughput the simulated target saw for each. The dump
+# scenarios run the other way, the target sending the image for scomm to take.
+#
+# The last scenario flashes several simulated boards, patch and image, from
+# one scomm; its throughput is for all of them together.
+#
+# BAUD, SIZE (image bytes) and LATENCY (ms each way) override the defaults,
+# and DEVICES the number of boards flashed at once.
+
+BAUD=${BAUD:-115200}
+SIZE=${SIZE:-65536}
+LATENCY=${LATENCY:-0}
+DEVICES=${DEVICES:-4}
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/out" "$dir/in"
+head -c "$SIZE" /dev/urandom > "$dir/image.bin"
+head -c 1024 /dev/urandom > "$dir/patch.bin"
+
+failed=0
+printf '%-28s %10s %10s\n' scenario seconds KB/s
+
+run() {
+    name=$1
+    shift
+    result=$(./trs20sim -b "$BAUD" -l "$LATENCY" -o "$dir/out" "$@" | grep -E '^sim: (patch|ymodem|zmodem|dump) [0-9]' | tail -1)
+    if [ -z "$result" ]; then
+        printf '%-28s %10s\n' "$name" FAILED
+        failed=1
+        return
+    fi
+    echo "$result" | awk -v name="$name" '{ printf "%-28s %10s %10s\n", name, substr($6, 1, length($6) - 2), $7 }'
+}
+
+# compare the image with the copy that arrived in $1, $dir/out by default
+check() {
+    out=${1:-$dir/out}
+    if ! cmp -s "$dir/image.bin" "$out/image.bin"; then
+        echo "  received image differs"
+        failed=1
+    fi
+    rm -f "$out/image.bin"
+}
+
+# run scomm headless against $1 simulated boards, each in its own trs20sim with the rest of the options
+run_devices() {
+    name=$1
+    count=$2
+    shift 2
+    pids=
+    ptys=
+    for i in $(seq "$count"); do
+        mkdir -p "$dir/out$i"
+        ./trs20sim -b "$BAUD" -l "$LATENCY" -o "$dir/out$i" "$@" > "$dir/sim$i.log" &
+        pids="$pids $!"
+    done
+    for i in $(seq "$count"); do
+        while [ ! -s "$dir/sim$i.log" ]; do sleep 0.05; done
+        ptys="$ptys $(head -1 "$dir/sim$i.log")"
+    done
+    result=$(./scomm -b "$BAUD" -c "p $dir/patch.bin" -c "y -k $dir/image.bin" $ptys | grep -E '^[0-9]+ of [0-9]+ devices ok')
+    kill $pids 2> /dev/null
+    wait 2> /dev/null
+    if ! echo "$result" | grep -q "^$count of $count "; then
+        printf '%-28s %10s\n' "$name" FAILED
+        failed=1
+        return
+    fi
+    echo "$result" | awk -v name="$name" -v bytes=$((count * SIZE)) \
+        '{ s = substr($NF, 1, length($NF) - 1); printf "%-28s %10s %10.1f\n", name, s, bytes / s / 1024 }'
+    for i in $(seq "$count"); do
+        if ! cmp -s "$dir/image.bin" "$dir/out$i/image.bin"; then
+            echo "  received image differs on board $i"
+            failed=1
+        fi
+    done
+}
+
+run "patch (buggy bootrom)" -a -p "$dir/patch.bin" -- ./scomm -b "$BAUD" -c "p $dir/patch.bin" -x {}
+run "patch, calibrated (last try)" -a -p "$dir/patch.bin" -- ./scomm -b "$BAUD" -c "p -a $dir/patch.bin" -x {}
+run "ymodem 128" -a -m patched -- ./scomm -b "$BAUD" -c "y $dir/image.bin" -x {}
+check
+run "ymodem-1k" -a -m patched -- ./scomm -b "$BAUD" -c "y -k $dir/image.bin" -x {}
+check
+run "ymodem-g" -a -m patched -G -- ./scomm -b "$BAUD" -c "y -k $dir/image.bin" -x {}
+check
+run "ymodem-1k, low latency" -a -m patched -- ./scomm -b "$BAUD" -c "l on" -c "y -k $dir/image.bin" -x {}
+check
+run "ymodem-1k, corrupt 1e-4" -a -m patched -c 0.0001 -s 7 -- ./scomm -b "$BAUD" -c "y -k $dir/image.bin" -x {}
+check
+run "ymodem-1k, 2% acks lost" -a -m patched -d 0.02 -s 7 -- ./scomm -b "$BAUD" -c "y -k $dir/image.bin" -x {}
+check
+run "zmodem" -a -z -- ./scomm -b "$BAUD" -c "z $dir/image.bin" -x {}
+check
+run "zmodem, corrupt 1e-4" -a -z -c 0.0001 -s 7 -- ./scomm -b "$BAUD" -c "z $dir/image.bin" -x {}
+check
+# break the first transfer off half way, then pick it up from what the target kept
+./trs20sim -b "$BAUD" -l "$LATENCY" -o "$dir/out" -a -z -i $((SIZE / 2)) -- ./scomm -b "$BAUD" -c "z $dir/image.bin" -x {} > /dev/null
+run "zmodem, resumed at half" -a -z -- ./scomm -b "$BAUD" -c "z -r $dir/image.bin" -x {}
+check
+run "dump (ymodem-1k rx)" -a -S "$dir/image.bin" -- ./scomm -b "$BAUD" -c "g $dir/in" -x {}
+check "$dir/in"
+run "dump, corrupt 1e-4" -a -S "$dir/image.bin" -c 0.0001 -s 7 -- ./scomm -b "$BAUD" -c "g $dir/in" -x {}
+check "$dir/in"
+run_devices "$DEVICES boards, patch + 1k" "$DEVICES" -a -p "$dir/patch.bin"
+
+exit $failed
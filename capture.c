@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "stats.h"
+#include "console.h"
+#include "capture.h"
+
+static void put_le(uint8_t *p, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint64_t get_le(const uint8_t *p, int size)
+{
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+// one record a line: unlike the console, CR and LF are escaped too
+static void export_record(FILE *text, uint64_t usec, int direction, const uint8_t *data, size_t size)
+{
+    static const char hex[] = "0123456789abcdef";
+    fprintf(text, "%10.6f %s ", usec / 1e6, direction == CAPTURE_RX ? "rx" : "tx");
+    for (size_t i = 0; i < size; i++) {
+        if (isprint(data[i])) {
+            putc(data[i], text);
+        } else {
+            putc('<', text);
+            putc(hex[data[i] >> 4], text);
+            putc(hex[data[i] & 0xf], text);
+            putc('>', text);
+        }
+    }
+    putc('\n', text);
+}
+
+static void *capture_writer(void *arg)
+{
+    capture *cap = arg;
+    uint8_t record[CAPTURE_HEADER + CAPTURE_CHUNK];
+
+    for (;;) {
+        size_t head, tail;
+        int pending = ring_pending(&cap->ring, &head, &tail);
+        if (pending < 0) break;
+        if (!pending) {
+            fflush(cap->log);
+            fflush(cap->text);
+            ring_nap(CAPTURE_IDLE_USEC);
+            continue;
+        }
+
+        while (head != tail) {
+            ring_read(&cap->ring, head, record, CAPTURE_HEADER);
+            size_t size = get_le(record + 9, 2);
+            ring_read(&cap->ring, head + CAPTURE_HEADER, record + CAPTURE_HEADER, size);
+            fwrite(record, 1, CAPTURE_HEADER + size, cap->log);
+            export_record(cap->text, get_le(record, 8), record[8], record + CAPTURE_HEADER, size);
+            head += CAPTURE_HEADER + size;
+        }
+        ring_consumed(&cap->ring, head);
+    }
+
+    fflush(cap->log);
+    fflush(cap->text);
+    return NULL;
+}
+
+int capture_open(capture *cap, const char *path)
+{
+    memset(cap, 0, sizeof(capture));
+    char text_path[1024];
+    snprintf(text_path, sizeof(text_path), "%s.txt", path);
+
+    cap->log = fopen(path, "wb");
+    if (!cap->log) {
+        perror(path);
+        return 0;
+    }
+    cap->text = fopen(text_path, "w");
+    if (!cap->text) {
+        perror(text_path);
+        fclose(cap->log);
+        return 0;
+    }
+    if (!ring_open(&cap->ring, CAPTURE_RING)) {
+        perror("can't allocate the capture ring");
+        fclose(cap->log);
+        fclose(cap->text);
+        return 0;
+    }
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint8_t header[sizeof(CAPTURE_MAGIC) - 1 + 8];
+    memcpy(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+    put_le(header + sizeof(CAPTURE_MAGIC) - 1, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec, 8);
+    fwrite(header, 1, sizeof(header), cap->log);
+    fprintf(cap->text, "# capture started %s", ctime(&tv.tv_sec));
+    cap->start = stats_now();
+
+    if (pthread_create(&cap->writer, NULL, capture_writer, cap) != 0) {
+        perror("can't start capture writer");
+        fclose(cap->log);
+        fclose(cap->text);
+        ring_close(&cap->ring);
+        return 0;
+    }
+    return 1;
+}
+
+void capture_close(capture *cap)
+{
+    ring_stop(&cap->ring);
+    pthread_join(cap->writer, NULL);
+    if (cap->dropped) {
+        fprintf(cap->text, "# %llu bytes dropped, the writer fell behind\n", (unsigned long long)cap->dropped);
+    }
+    fclose(cap->log);
+    fclose(cap->text);
+    ring_close(&cap->ring);
+}
+
+void capture_put(capture *cap, int direction, const void *data, size_t size)
+{
+    uint64_t usec = (uint64_t)((stats_now() - cap->start) * 1e6);
+    const uint8_t *p = data;
+
+    while (size > 0) {
+        size_t chunk = size < CAPTURE_CHUNK ? size : CAPTURE_CHUNK;
+        size_t tail;
+        if (ring_room(&cap->ring, &tail) < CAPTURE_HEADER + chunk) {
+            cap->dropped += size;
+            return;
+        }
+
+        uint8_t header[CAPTURE_HEADER];
+        put_le(header, usec, 8);
+        header[8] = direction;
+        put_le(header + 9, chunk, 2);
+        ring_write(&cap->ring, tail, header, CAPTURE_HEADER);
+        ring_write(&cap->ring, tail + CAPTURE_HEADER, p, chunk);
+        ring_publish(&cap->ring, tail + CAPTURE_HEADER + chunk);
+
+        cap->bytes += chunk;
+        p += chunk;
+        size -= chunk;
+    }
+}
+
+int capture_replay(const char *path, int fd)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t header[sizeof(CAPTURE_MAGIC) - 1 + 8];
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) != 0) {
+        fprintf(stderr, "%s: not a capture log\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    uint8_t record[CAPTURE_HEADER + CAPTURE_CHUNK];
+    char out[4 * CAPTURE_CHUNK];
+    while (fread(record, 1, CAPTURE_HEADER, f) == CAPTURE_HEADER) {
+        size_t size = get_le(record + 9, 2);
+        if (size > CAPTURE_CHUNK || fread(record + CAPTURE_HEADER, 1, size, f) != size) {
+            fprintf(stderr, "%s: truncated record\n", path);
+            break;
+        }
+        if (record[8] == CAPTURE_RX) {
+            write_all(fd, out, console_render(record + CAPTURE_HEADER, size, out));
+        }
+    }
+    fclose(f);
+    return 0;
+}
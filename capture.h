@@ -0,0 +1,53 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "ring.h"
+
+/*
+ * A capture log of one serial device. The loop hands each chunk of RX or TX
+ * traffic, timestamped, to a single-producer single-consumer ring, and a
+ * writer thread takes it from there to a binary log and a text export. The
+ * loop never waits on the disk: when the ring is full the chunk is dropped
+ * and counted instead.
+ *
+ * The binary log is CAPTURE_MAGIC, the start time as microseconds since the
+ * epoch, then one record per chunk: microseconds since the start, direction
+ * and length, all little-endian, followed by the bytes. The text export has
+ * a line per record with non-printables, CR and LF included, as <xx>.
+ */
+
+#define CAPTURE_RX              'r'             // device output
+#define CAPTURE_TX              't'             // what went to the device
+
+#define CAPTURE_MAGIC           "SCAP1\n"
+#define CAPTURE_RING            (1 << 20)       // ring bytes, a power of two
+#define CAPTURE_HEADER          11              // record header: 8-byte time, direction, 2-byte length
+#define CAPTURE_CHUNK           4096            // longest record, longer chunks are split
+#define CAPTURE_IDLE_USEC       5000            // writer's nap when the ring is empty
+
+typedef struct capture
+{
+    ring ring;                  // records waiting for the writer
+    pthread_t writer;
+    FILE *log;                  // binary log
+    FILE *text;                 // text export
+    double start;               // stats_now() when the capture began
+    uint64_t bytes;             // traffic captured
+    uint64_t dropped;           // traffic the ring had no room for
+} capture;
+
+// start capturing to path and path.txt, returns 1 if successful
+int capture_open(capture *cap, const char *path);
+// stop the writer once it has written everything, and close the files
+void capture_close(capture *cap);
+// queue a chunk of traffic for the writer; never blocks
+void capture_put(capture *cap, int direction, const void *data, size_t size);
+// render the device output in a capture on fd, as the console showed it; returns 0 on success
+int capture_replay(const char *path, int fd);
+
+#endif
@@ -0,0 +1,42 @@
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "console.h"
+
+void write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    while (size > 0) {
+        ssize_t sent = write(fd, p, size);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        p += sent;
+        size -= sent;
+    }
+}
+
+size_t console_render(const uint8_t *in, size_t size, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *o = out;
+    size_t i = 0;
+    while (i < size) {
+        // copy runs of plain text in one go, they're the bulk of any console dump
+        size_t run = i;
+        while (run < size && (isprint(in[run]) || in[run] == 13 || in[run] == 10 || in[run] == 8)) run++;
+        memcpy(o, in + i, run - i);
+        o += run - i;
+        if ((i = run) == size) break;
+
+        *o++ = '<';
+        *o++ = hex[in[i] >> 4];
+        *o++ = hex[in[i] & 0xf];
+        *o++ = '>';
+        i++;
+    }
+    return o - out;
+}
@@ -0,0 +1,12 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// write all of a buffer to a blocking fd such as the terminal
+void write_all(int fd, const void *data, size_t size);
+// render device output for the terminal, escaping non-printables as <xx>; out needs 4 bytes per input byte
+size_t console_render(const uint8_t *in, size_t size, char *out);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+/*
+ * A minimal readiness event loop, with a kqueue backend (evloop_kqueue.c) for
+ * the BSDs and macOS and an epoll/timerfd/signalfd backend (evloop_epoll.c)
+ * for Linux. The Makefile picks the backend for the host.
+ */
+
+#define EVL_READ                1               // fd is readable
+#define EVL_WRITE               2               // fd is writable
+#define EVL_TIMER               3               // a one-shot timer fired
+#define EVL_SIGNAL              4               // a signal was delivered
+
+#define EVL_EDGE                1               // evl_add_fd: edge-triggered, caller drains the fd
+
+#define EVL_MAX_FDS             64              // fds one loop can watch
+#define EVL_MAX_TIMERS          32              // timer ids are 0 .. EVL_MAX_TIMERS-1
+
+typedef struct evl_event
+{
+    int filter;                 // EVL_XXX constant
+    int ident;                  // fd, timer id or signal number
+    int eof;                    // fd hung up or hit EOF
+} evl_event;
+
+typedef struct evloop evloop;
+
+evloop *evl_open(void);
+void evl_close(evloop *loop);
+
+// watch fd for reads; write readiness starts disabled
+int evl_add_fd(evloop *loop, int fd, int flags);
+int evl_remove_fd(evloop *loop, int fd);
+
+// arm or disarm write readiness; arming always reports the fd once it is (still) writable
+int evl_set_write(evloop *loop, int fd, int enable);
+
+// deliver signo through the loop instead of a handler
+int evl_add_signal(evloop *loop, int signo);
+
+// (re)arm one-shot timer id to fire after usec microseconds, or cancel it if usec is 0
+int evl_set_timer(evloop *loop, int id, long usec);
+
+// wait for events, returning how many were stored, or -1 on error; max must be at least 2
+int evl_wait(evloop *loop, evl_event *events, int max);
+
+#endif
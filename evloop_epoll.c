@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "evloop.h"
+
+// epoll data carries the event kind in the high word and the ident in the low word
+#define TAG(kind, ident)        (((uint64_t)(kind) << 32) | (uint32_t)(ident))
+#define TAG_KIND(data)          ((int)((data) >> 32))
+#define TAG_IDENT(data)         ((int)(uint32_t)(data))
+
+#define KIND_FD                 0
+#define KIND_TIMER              1
+#define KIND_SIGNAL             2
+
+typedef struct evl_fd
+{
+    int fd;                     // watched fd, -1 if the slot is free
+    uint32_t events;            // EPOLLIN plus EPOLLET if edge-triggered
+} evl_fd;
+
+struct evloop
+{
+    int epfd;
+    int sigfd;                  // signalfd, -1 until a signal is added
+    sigset_t signals;           // signals routed through sigfd
+    int timers[EVL_MAX_TIMERS]; // timerfd per timer id, -1 until first armed
+    evl_fd fds[EVL_MAX_FDS];
+};
+
+evloop *evl_open(void)
+{
+    evloop *loop = malloc(sizeof(evloop));
+    if (!loop) return NULL;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+    loop->sigfd = -1;
+    sigemptyset(&loop->signals);
+    for (int i = 0; i < EVL_MAX_TIMERS; i++) loop->timers[i] = -1;
+    for (int i = 0; i < EVL_MAX_FDS; i++) loop->fds[i].fd = -1;
+
+    return loop;
+}
+
+void evl_close(evloop *loop)
+{
+    for (int i = 0; i < EVL_MAX_TIMERS; i++) {
+        if (loop->timers[i] != -1) close(loop->timers[i]);
+    }
+    if (loop->sigfd != -1) {
+        close(loop->sigfd);
+        sigprocmask(SIG_UNBLOCK, &loop->signals, NULL);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+static evl_fd *find_fd(evloop *loop, int fd)
+{
+    for (int i = 0; i < EVL_MAX_FDS; i++) {
+        if (loop->fds[i].fd == fd) return &loop->fds[i];
+    }
+    return NULL;
+}
+
+int evl_add_fd(evloop *loop, int fd, int flags)
+{
+    evl_fd *slot = find_fd(loop, -1);
+    if (!slot) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | ((flags & EVL_EDGE) ? EPOLLET : 0);
+    ev.data.u64 = TAG(KIND_FD, fd);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) return -1;
+
+    slot->fd = fd;
+    slot->events = ev.events;
+    return 0;
+}
+
+int evl_remove_fd(evloop *loop, int fd)
+{
+    evl_fd *slot = find_fd(loop, fd);
+    if (slot) slot->fd = -1;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int evl_set_write(evloop *loop, int fd, int enable)
+{
+    evl_fd *slot = find_fd(loop, fd);
+    if (!slot) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // a MOD re-evaluates readiness, so this re-arms an edge-triggered write too
+    struct epoll_event ev;
+    ev.events = slot->events | (enable ? EPOLLOUT : 0);
+    ev.data.u64 = TAG(KIND_FD, fd);
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int evl_add_signal(evloop *loop, int signo)
+{
+    sigaddset(&loop->signals, signo);
+    if (sigprocmask(SIG_BLOCK, &loop->signals, NULL) == -1) return -1;
+
+    int first = loop->sigfd == -1;
+    loop->sigfd = signalfd(loop->sigfd, &loop->signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (loop->sigfd == -1) return -1;
+
+    if (first) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = TAG(KIND_SIGNAL, 0);
+        return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sigfd, &ev);
+    }
+    return 0;
+}
+
+int evl_set_timer(evloop *loop, int id, long usec)
+{
+    if (id < 0 || id >= EVL_MAX_TIMERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (loop->timers[id] == -1) {
+        if (usec == 0) return 0;
+        loop->timers[id] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (loop->timers[id] == -1) return -1;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = TAG(KIND_TIMER, id);
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timers[id], &ev) == -1) return -1;
+    }
+
+    // an all-zero it_value disarms the timer
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = usec / 1000000;
+    spec.it_value.tv_nsec = (usec % 1000000) * 1000;
+    return timerfd_settime(loop->timers[id], 0, &spec, NULL);
+}
+
+int evl_wait(evloop *loop, evl_event *events, int max)
+{
+    // an fd entry can make both a read and a write event, so ask for half as many entries as there is room for events;
+    // with EPOLLET an entry taken and then dropped would be an edge lost for good
+    struct epoll_event evList[16];
+    int entries = max / 2;
+    if (entries > 16) entries = 16;
+    if (entries < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int nev = epoll_wait(loop->epfd, evList, entries, -1);
+    if (nev == -1) return errno == EINTR ? 0 : -1;
+
+    int count = 0;
+    for (int i = 0; i < nev; i++) {
+        uint64_t data = evList[i].data.u64;
+        uint64_t expirations;
+        struct signalfd_siginfo info;
+
+        switch (TAG_KIND(data)) {
+            case KIND_FD:
+                // a read and a write can be ready at once, report them separately
+                if (evList[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    events[count].filter = EVL_READ;
+                    events[count].ident = TAG_IDENT(data);
+                    events[count].eof = (evList[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+                    count++;
+                }
+                if (evList[i].events & EPOLLOUT) {
+                    events[count].filter = EVL_WRITE;
+                    events[count].ident = TAG_IDENT(data);
+                    events[count].eof = 0;
+                    count++;
+                }
+                break;
+            case KIND_TIMER:
+                // drain the expiry count; a stale expiry from a re-armed timer reads nothing
+                if (read(loop->timers[TAG_IDENT(data)], &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    events[count].filter = EVL_TIMER;
+                    events[count].ident = TAG_IDENT(data);
+                    events[count].eof = 0;
+                    count++;
+                }
+                break;
+            case KIND_SIGNAL:
+                // one at a time, the signalfd is level-triggered so any others come on the next wait
+                if (read(loop->sigfd, &info, sizeof(info)) == sizeof(info)) {
+                    events[count].filter = EVL_SIGNAL;
+                    events[count].ident = info.ssi_signo;
+                    events[count].eof = 0;
+                    count++;
+                }
+                break;
+        }
+    }
+
+    return count;
+}
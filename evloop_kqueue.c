@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include "evloop.h"
+
+struct evloop
+{
+    int kq;
+};
+
+evloop *evl_open(void)
+{
+    evloop *loop = malloc(sizeof(evloop));
+    if (!loop) return NULL;
+
+    loop->kq = kqueue();
+    if (loop->kq == -1) {
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+void evl_close(evloop *loop)
+{
+    close(loop->kq);
+    free(loop);
+}
+
+int evl_add_fd(evloop *loop, int fd, int flags)
+{
+    struct kevent evset[2];
+    EV_SET(&evset[0], fd, EVFILT_READ, EV_ADD | ((flags & EVL_EDGE) ? EV_CLEAR : 0), 0, 0, NULL);
+    EV_SET(&evset[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, NULL);
+    return kevent(loop->kq, evset, 2, NULL, 0, NULL);
+}
+
+int evl_remove_fd(evloop *loop, int fd)
+{
+    struct kevent evset[2];
+    EV_SET(&evset[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&evset[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    return kevent(loop->kq, evset, 2, NULL, 0, NULL);
+}
+
+int evl_set_write(evloop *loop, int fd, int enable)
+{
+    // write stays level-triggered, so an enabled filter keeps firing while the fd is writable
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_WRITE, EV_ADD | (enable ? EV_ENABLE : EV_DISABLE), 0, 0, NULL);
+    return kevent(loop->kq, &ev, 1, NULL, 0, NULL);
+}
+
+int evl_add_signal(evloop *loop, int signo)
+{
+    // EVFILT_SIGNAL only observes signals, the default action has to be switched off
+    signal(signo, SIG_IGN);
+
+    struct kevent ev;
+    EV_SET(&ev, signo, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+    return kevent(loop->kq, &ev, 1, NULL, 0, NULL);
+}
+
+int evl_set_timer(evloop *loop, int id, long usec)
+{
+    if (id < 0 || id >= EVL_MAX_TIMERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct kevent ev;
+    if (usec == 0) {
+        EV_SET(&ev, id, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        if (kevent(loop->kq, &ev, 1, NULL, 0, NULL) == -1 && errno != ENOENT) return -1;
+        return 0;
+    }
+
+    EV_SET(&ev, id, EVFILT_TIMER, EV_ADD | EV_ONESHOT, NOTE_USECONDS, usec, NULL);
+    return kevent(loop->kq, &ev, 1, NULL, 0, NULL);
+}
+
+int evl_wait(evloop *loop, evl_event *events, int max)
+{
+    struct kevent evList[32];
+    if (max > 32) max = 32;
+
+    int nev = kevent(loop->kq, NULL, 0, evList, max, NULL);
+    if (nev == -1) return errno == EINTR ? 0 : -1;
+
+    for (int i = 0; i < nev; i++) {
+        switch (evList[i].filter) {
+            case EVFILT_READ:
+                events[i].filter = EVL_READ;
+                break;
+            case EVFILT_WRITE:
+                events[i].filter = EVL_WRITE;
+                break;
+            case EVFILT_TIMER:
+                events[i].filter = EVL_TIMER;
+                break;
+            case EVFILT_SIGNAL:
+                events[i].filter = EVL_SIGNAL;
+                break;
+        }
+        events[i].ident = (int)evList[i].ident;
+        events[i].eof = (evList[i].flags & EV_EOF) != 0;
+    }
+
+    return nev;
+}
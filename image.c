@@ -0,0 +1,338 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "image.h"
+
+int image_load(image *img, const char *filename, struct stat *filestat)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror(filename);
+        return 0;
+    }
+
+    if (fstat(fd, filestat) != 0) {
+        perror(filename);
+        close(fd);
+        return 0;
+    }
+
+    img->data = NULL;
+    img->size = filestat->st_size;
+    img->mapped = 0;
+    if (img->size > 0) {
+        void *map = mmap(NULL, img->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, img->size, MADV_SEQUENTIAL);
+            img->data = map;
+            img->mapped = 1;
+        } else {
+            uint8_t *buffer = malloc(img->size);
+            size_t got = 0;
+            ssize_t rx = 1;
+            while (buffer && got < img->size && (rx = read(fd, buffer + got, img->size - got)) > 0) {
+                got += rx;
+            }
+            if (!buffer || rx < 0) {
+                perror(filename);
+                free(buffer);
+                close(fd);
+                return 0;
+            }
+            img->data = buffer;
+            img->size = got;
+        }
+    }
+
+    close(fd);
+    return 1;
+}
+
+void image_unload(image *img)
+{
+    if (img->mapped) {
+        munmap((void *)img->data, img->size);
+    } else {
+        free((void *)img->data);
+    }
+    img->data = NULL;
+    img->size = 0;
+    img->mapped = 0;
+}
+
+// segments as they're parsed, the last one growing while records carry on from where it ends
+typedef struct segment_list
+{
+    image_segment *segments;
+    int count;
+    int allocated;
+    size_t capacity;            // bytes allocated for the last segment's data
+} segment_list;
+
+static void segment_add(segment_list *list, uint64_t addr, const uint8_t *data, size_t size)
+{
+    if (size == 0) return;
+    image_segment *last = list->count ? &list->segments[list->count - 1] : NULL;
+    if (!last || addr != last->addr + last->size) {
+        if (list->count == list->allocated) {
+            list->allocated = list->allocated ? 2 * list->allocated : 8;
+            list->segments = realloc(list->segments, list->allocated * sizeof(image_segment));
+        }
+        last = &list->segments[list->count++];
+        last->addr = addr;
+        last->size = 0;
+        last->data = NULL;
+        list->capacity = 0;
+    }
+    if (last->size + size > list->capacity) {
+        list->capacity = 2 * (last->size + size);
+        last->data = realloc(last->data, list->capacity);
+    }
+    memcpy(last->data + last->size, data, size);
+    last->size += size;
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+    const image_segment *x = a, *y = b;
+    return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// sort, refuse overlaps, and fold in segments that follow a small gap
+static int segment_finish(segment_list *list, const char *filename)
+{
+    qsort(list->segments, list->count, sizeof(image_segment), segment_compare);
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        image_segment *seg = &list->segments[i];
+        image_segment *prev = kept ? &list->segments[kept - 1] : NULL;
+        if (prev && seg->addr < prev->addr + prev->size) {
+            fprintf(stderr, "%s: data at 0x%llx overlaps the range before it\n", filename, (unsigned long long)seg->addr);
+            for (int j = i; j < list->count; j++) free(list->segments[j].data);
+            image_free_segments(list->segments, kept);
+            return -1;
+        }
+        if (prev && seg->addr - (prev->addr + prev->size) <= IMAGE_MERGE_GAP) {
+            size_t gap = seg->addr - (prev->addr + prev->size);
+            prev->data = realloc(prev->data, prev->size + gap + seg->size);
+            memset(prev->data + prev->size, IMAGE_GAP_FILL, gap);
+            memcpy(prev->data + prev->size + gap, seg->data, seg->size);
+            prev->size += gap + seg->size;
+            free(seg->data);
+        } else {
+            list->segments[kept++] = *seg;
+        }
+    }
+    list->count = kept;
+    return kept;
+}
+
+static int hex_digit(uint8_t c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// decode the hex digits of a record up to the end of its line; returns how many bytes, or -1
+static int record_bytes(const uint8_t *p, const uint8_t *end, uint8_t *out, int max)
+{
+    int count = 0;
+    while (p < end && *p != '\r' && *p != '\n') {
+        int hi = hex_digit(p[0]);
+        int lo = p + 1 < end ? hex_digit(p[1]) : -1;
+        if (hi < 0 || lo < 0 || count == max) return -1;
+        out[count++] = hi << 4 | lo;
+        p += 2;
+    }
+    return count;
+}
+
+// address bytes of an S-record type: S0/S1/S5/S9 two, S2/S6/S8 three, S3/S7 four; -1 if there's no such type
+static int srec_address_length(int type)
+{
+    switch (type) {
+        case 0: case 1: case 5: case 9: return 2;
+        case 2: case 6: case 8: return 3;
+        case 3: case 7: return 4;
+    }
+    return -1;
+}
+
+// decode one record, up to the end of its line, and check its length and checksum; returns its byte count, or -1
+static int record_decode(int format, const uint8_t *p, const uint8_t *eol, uint8_t *record)
+{
+    uint8_t sum = 0;
+    if (format == IMAGE_IHEX) {
+        // :LLAAAATT data CC, summing to zero
+        if (p == eol || *p != ':') return -1;
+        int n = record_bytes(p + 1, eol, record, IMAGE_RECORD_MAX);
+        for (int i = 0; i < n; i++) sum += record[i];
+        return n >= 5 && n == record[0] + 5 && sum == 0 ? n : -1;
+    }
+    // Stcount address data checksum, the sum's low byte all ones
+    if (eol - p < 2 || *p != 'S') return -1;
+    int addr_len = srec_address_length(p[1] - '0');
+    int n = record_bytes(p + 2, eol, record, IMAGE_RECORD_MAX);
+    for (int i = 0; i < n; i++) sum += record[i];
+    return addr_len > 0 && n >= addr_len + 2 && n == record[0] + 1 && sum == 0xff ? n : -1;
+}
+
+int image_format(const char *filename)
+{
+    uint8_t head[IMAGE_LINE_MAX];
+    FILE *f = fopen(filename, "rb");
+    if (!f) return IMAGE_RAW;
+    size_t got = fread(head, 1, sizeof(head), f);
+    fclose(f);
+
+    if (got >= 4 && memcmp(head, "\x7f" "ELF", 4) == 0) return IMAGE_ELF;
+
+    // text only if the whole first line is a good record, as a binary could start with ':' or "S1" by chance
+    const uint8_t *eol = memchr(head, '\n', got);
+    if (!eol && got == sizeof(head)) return IMAGE_RAW;
+    if (!eol) eol = head + got;
+    uint8_t record[IMAGE_RECORD_MAX];
+    if (record_decode(IMAGE_IHEX, head, eol, record) > 0) return IMAGE_IHEX;
+    if (record_decode(IMAGE_SREC, head, eol, record) > 0) return IMAGE_SREC;
+    return IMAGE_RAW;
+}
+
+// Intel HEX and S-record: a record a line, addresses per record
+static int parse_text(const image *img, int format, segment_list *list, const char *filename)
+{
+    const uint8_t *p = img->data;
+    const uint8_t *end = img->data + img->size;
+    uint64_t base = 0;
+    uint8_t record[IMAGE_RECORD_MAX];
+    int line = 0;
+
+    while (p < end) {
+        const uint8_t *eol = memchr(p, '\n', end - p);
+        if (!eol) eol = end;
+        line++;
+        while (p < eol && isspace(*p)) p++;
+        if (p == eol) {
+            p = eol + 1;
+            continue;
+        }
+
+        int n = record_decode(format, p, eol, record);
+        int done = 0;
+        if (n > 0 && format == IMAGE_IHEX) {
+            uint64_t addr = record[1] << 8 | record[2];
+            switch (record[3]) {
+                case 0: segment_add(list, base + addr, record + 4, record[0]); break;
+                case 1: done = 1; break;
+                case 2: base = (uint64_t)(record[4] << 8 | record[5]) << 4; break;
+                case 4: base = (uint64_t)(record[4] << 8 | record[5]) << 16; break;
+            }
+        } else if (n > 0) {
+            int type = p[1] - '0';
+            int addr_len = srec_address_length(type);
+            if (type >= 1 && type <= 3) {
+                uint64_t addr = 0;
+                for (int i = 0; i < addr_len; i++) addr = addr << 8 | record[1 + i];
+                segment_add(list, addr, record + 1 + addr_len, record[0] - addr_len - 1);
+            }
+            done = type >= 7 && type <= 9;
+        }
+        if (n < 0) {
+            fprintf(stderr, "%s:%d: bad record\n", filename, line);
+            return 0;
+        }
+        if (done) break;
+        p = eol + 1;
+    }
+    return 1;
+}
+
+static uint64_t elf_read(const uint8_t *p, int size, int big)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value = value << 8 | p[big ? i : size - 1 - i];
+    }
+    return value;
+}
+
+#define ELF32_HEADER            52              // bytes in the file header of a 32-bit ELF
+#define ELF64_HEADER            64              // and a 64-bit one
+#define ELF32_PHDR              32              // bytes in a program header entry of a 32-bit ELF
+#define ELF64_PHDR              56              // and 64-bit
+
+// ELF: the file bytes of each PT_LOAD segment, at its physical (load) address
+static int parse_elf(const image *img, segment_list *list, const char *filename)
+{
+    const uint8_t *d = img->data;
+    if (img->size < 6 || (d[4] != 1 && d[4] != 2) || (d[5] != 1 && d[5] != 2)
+        || img->size < (d[4] == 2 ? ELF64_HEADER : ELF32_HEADER)) {
+        fprintf(stderr, "%s: unsupported ELF header\n", filename);
+        return 0;
+    }
+    int wide = d[4] == 2;
+    int big = d[5] == 2;
+    uint64_t phoff = wide ? elf_read(d + 0x20, 8, big) : elf_read(d + 0x1c, 4, big);
+    size_t phentsize = elf_read(d + (wide ? 0x36 : 0x2a), 2, big);
+    size_t phnum = elf_read(d + (wide ? 0x38 : 0x2c), 2, big);
+    if (phnum > 0 && phentsize < (wide ? ELF64_PHDR : ELF32_PHDR)) {
+        fprintf(stderr, "%s: program header entries too small\n", filename);
+        return 0;
+    }
+    if (phoff > img->size || phnum * phentsize > img->size - phoff) {
+        fprintf(stderr, "%s: program headers out of range\n", filename);
+        return 0;
+    }
+
+    for (size_t i = 0; i < phnum; i++) {
+        const uint8_t *ph = d + phoff + i * phentsize;
+        if (elf_read(ph, 4, big) != 1) continue;         // PT_LOAD
+        uint64_t offset = wide ? elf_read(ph + 8, 8, big) : elf_read(ph + 4, 4, big);
+        uint64_t paddr = wide ? elf_read(ph + 24, 8, big) : elf_read(ph + 12, 4, big);
+        uint64_t filesz = wide ? elf_read(ph + 32, 8, big) : elf_read(ph + 16, 4, big);
+        if (offset > img->size || filesz > img->size - offset) {
+            fprintf(stderr, "%s: segment %zu out of range\n", filename, i);
+            return 0;
+        }
+        segment_add(list, paddr, d + offset, filesz);
+    }
+    return 1;
+}
+
+int image_segments(const char *filename, image_segment **segments)
+{
+    int format = image_format(filename);
+    image img;
+    struct stat filestat;
+    if (format == IMAGE_RAW || !image_load(&img, filename, &filestat)) {
+        return -1;
+    }
+
+    segment_list list = { 0 };
+    int ok = format == IMAGE_ELF ? parse_elf(&img, &list, filename) : parse_text(&img, format, &list, filename);
+    image_unload(&img);
+    if (!ok) {
+        image_free_segments(list.segments, list.count);
+        return -1;
+    }
+
+    int count = segment_finish(&list, filename);
+    if (count >= 0) *segments = list.segments;
+    return count;
+}
+
+void image_free_segments(image_segment *segments, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(segments[i].data);
+    }
+    free(segments);
+}
@@ -0,0 +1,44 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// a file to send, mapped if it can be and read in whole if not
+typedef struct image
+{
+    const uint8_t *data;
+    size_t size;
+    int mapped;                 // data is an mmap rather than a malloc
+} image;
+
+#define IMAGE_RAW               0               // plain binary, sent as it is
+#define IMAGE_IHEX              1               // Intel HEX
+#define IMAGE_SREC              2               // Motorola S-record
+#define IMAGE_ELF               3               // ELF, sent by its PT_LOAD segments
+
+#define IMAGE_MERGE_GAP         256             // gaps this small go as fill, cheaper than another file
+#define IMAGE_GAP_FILL          0xff            // erased flash
+#define IMAGE_RECORD_MAX        300             // decoded bytes of the longest HEX or S-record record
+#define IMAGE_LINE_MAX          600             // characters of the longest record line
+
+// one populated address range of a HEX, S-record or ELF file
+typedef struct image_segment
+{
+    uint64_t addr;              // load address
+    size_t size;
+    uint8_t *data;
+} image_segment;
+
+// load filename, filling in filestat; returns 1 if successful
+int image_load(image *img, const char *filename, struct stat *filestat);
+void image_unload(image *img);
+// IMAGE_XXX constant for the file's format: ELF by its magic, HEX or S-record if its first line is a good record
+int image_format(const char *filename);
+// parse the populated ranges of a HEX, S-record or ELF file, sorted by address and with small gaps filled;
+// returns how many, or -1 if the file is malformed or has overlapping ranges
+int image_segments(const char *filename, image_segment **segments);
+void image_free_segments(image_segment *segments, int count);
+
+#endif
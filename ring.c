@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ring.h"
+
+int ring_open(ring *r, size_t size)
+{
+    r->data = malloc(size);
+    if (!r->data) return 0;
+    r->size = size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->stop, 0);
+    return 1;
+}
+
+void ring_close(ring *r)
+{
+    free(r->data);
+    r->data = NULL;
+}
+
+void ring_read(const ring *r, size_t pos, void *out, size_t size)
+{
+    size_t at = pos & (r->size - 1);
+    size_t first = r->size - at < size ? r->size - at : size;
+    memcpy(out, r->data + at, first);
+    memcpy((uint8_t *)out + first, r->data, size - first);
+}
+
+void ring_write(ring *r, size_t pos, const void *in, size_t size)
+{
+    size_t at = pos & (r->size - 1);
+    size_t first = r->size - at < size ? r->size - at : size;
+    memcpy(r->data + at, in, first);
+    memcpy(r->data, (const uint8_t *)in + first, size - first);
+}
+
+size_t ring_room(ring *r, size_t *tail)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    *tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    return r->size - (*tail - head);
+}
+
+void ring_publish(ring *r, size_t tail)
+{
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+}
+
+void ring_stop(ring *r)
+{
+    atomic_store_explicit(&r->stop, 1, memory_order_release);
+}
+
+int ring_pending(ring *r, size_t *head, size_t *tail)
+{
+    // read stop before tail, so a stop seen here means everything before it is visible
+    int stop = atomic_load_explicit(&r->stop, memory_order_acquire);
+    *head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    *tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (*head != *tail) return 1;
+    return stop ? -1 : 0;
+}
+
+void ring_consumed(ring *r, size_t head)
+{
+    atomic_store_explicit(&r->head, head, memory_order_release);
+}
+
+void ring_nap(long usec)
+{
+    struct timespec nap = { usec / 1000000, usec % 1000000 * 1000 };
+    nanosleep(&nap, NULL);
+}
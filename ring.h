@@ -0,0 +1,45 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * A single-producer single-consumer byte ring for handing records from the
+ * event loop to a writer thread. Positions run freely and are masked into
+ * the buffer; the producer publishes up to tail, the consumer hands space
+ * back up to head, and neither ever waits on the other.
+ */
+
+typedef struct ring
+{
+    uint8_t *data;
+    size_t size;                // bytes, a power of two
+    _Atomic size_t head;        // consumed up to here, advanced by the writer
+    _Atomic size_t tail;        // produced up to here, advanced by the loop
+    _Atomic int stop;           // the writer drains the ring and exits
+} ring;
+
+// allocate size bytes, a power of two; returns 1 if successful
+int ring_open(ring *r, size_t size);
+void ring_close(ring *r);
+
+// copy in and out at a position, wrapping at the end
+void ring_read(const ring *r, size_t pos, void *out, size_t size);
+void ring_write(ring *r, size_t pos, const void *in, size_t size);
+
+// producer: the room left and where to write into it, then publish what was written up to tail
+size_t ring_room(ring *r, size_t *tail);
+void ring_publish(ring *r, size_t tail);
+// producer: the writer takes what's left and exits
+void ring_stop(ring *r);
+
+// consumer: records from *head to *tail; returns 1 if there are some, 0 if none yet, -1 once stopped and drained
+int ring_pending(ring *r, size_t *head, size_t *tail);
+// consumer: hand the room up to head back to the producer
+void ring_consumed(ring *r, size_t head);
+// consumer: wait a while for more when there's nothing pending
+void ring_nap(long usec);
+
+#endif
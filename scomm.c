@@ -1,228 +1,66 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
 #include <signal.h>
-#include <libgen.h>
 #include <unistd.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/event.h>
-#include <sys/time.h>
-#include <arpa/inet.h>
+#include <termios.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 
-#include "trs20.h"
+#include "evloop.h"
+#include "session.h"
+#include "stats.h"
 
-#define STATE_CONSOLEIO         0               // just doing regular old console IO
-#define STATE_PATCHING          1               // faux-ymodem patch upload
-#define STATE_YMODEM            2               // ymodem transmit
+#define MAX_DEVICES             EVL_MAX_TIMERS  // each device's session needs a timer id of its own
 
-#define PATCH_Y                 0               // sent 'y', waiting a bit
-#define PATCH_PREAMBLE          1               // sending SOH/STX, 00, FF
-#define PATCH_XMIT              2               // transmitting file data
-#define PATCH_WAIT              3               // wait for a byte back
-#define PATCH_ABORT             4               // aborting transfer
-
-#define YMODEM_WAIT_C           0               // waiting for initial 'C'
-#define YMODEM_METADATA         1               // sending metadata packet
-#define YMODEM_META_ACK         2               // waiting for ACK
-#define YMODEM_WAIT_START       3               // waiting for file data C
-#define YMODEM_FILEDATA         4               // sending file data
-#define YMODEM_DATA_ACK         5               // waiting for ACK
-#define YMODEM_EOT              6               // sending EOT
-#define YMODEM_EOT_ACK          7               // waiting for ACK
-#define YMODEM_FINAL_C          8               // waiting for C to start next file
-#define YMODEM_TERMINATING      9               // sending NULL metadata
-#define YMODEM_FINAL_ACK        10              // waiting for final ACK
-
-typedef struct __attribute__((__packed__)) ym_packet
+// a device and how far it has got through the -c commands
+typedef struct device
 {
-    uint8_t type;
-    uint8_t seqno;
-    uint8_t seqcpl;
-    uint8_t payload[128];
-    uint16_t crc;
-} ym_packet;
-
-typedef struct ymodem_state
+    session s;
+    int script_idx;             // next command to run
+    int script_failed;          // commands that weren't accepted
+    int hungup;                 // EOF on the tty, or it wouldn't open: the device is out of the run
+    double finished;            // when it ran out of commands, 0 while still going
+} device;
+
+// the COMM> prompt runs on readline's callback interface, so the loop keeps serving the device while it's open
+static session *prompt_session;
+static int prompting;
+static struct termios raw_settings;
+
+// headless, a device that can't go on drops out of the run and the others carry on without it
+static void device_out(device *d, const char *why)
 {
-    int state;                  // YMODEM_XXX constant
-    FILE *input;                // The source file
-    ym_packet packet;           // The packet in flight
-    uint8_t packet_idx;         // index into the packet data
-    int cans;                   // CAN count
-} ymodem_state;
-
-volatile int quitit = 0;
-void sigint(int _unused) {
-    quitit = 1;
+    printf("%s: %s\n", d->s.device, why);
+    d->hungup = 1;
+    d->finished = stats_now();
 }
 
-// returns 0 if the ymodem transfer is over
-int ymodem_input(ymodem_state *state, uint8_t input)
+static void command_line(char *line)
 {
-
-    // Process CANcel bytes first
-    if (input == 0x18) {
-        if (++state->cans >= 2) {
-            return 0;
-        } else {
-            return 1;
+    rl_callback_handler_remove();
+    prompting = 0;
+    if (line) {
+        if (*line) {
+            add_history(line);
+            session_command(prompt_session, line);
         }
-    } else {
-        state->cans = 0;
+        free(line);
     }
-
-    switch (state->state) {
-        case YMODEM_WAIT_C:
-            if (input == 'C')
-                state->state = YMODEM_METADATA;
-            break;
-        case YMODEM_META_ACK:
-            if (input == 6)
-                state->state = YMODEM_WAIT_START;
-            else if (input == 'C')
-                state->state = YMODEM_METADATA;
-            break;
-        case YMODEM_WAIT_START:
-            if (input == 'C') {
-                memset(state->packet.payload, 0x1a, 128);
-                ssize_t rx = fread(state->packet.payload, 1, 128, state->input);
-                printf("read %ld bytes from input\n", rx); fflush(stdout);
-                if (feof(state->input) || ferror(state->input)) {
-                    state->packet.type = 1;
-                    state->packet.seqno = 0;
-                    state->packet.seqcpl = 0xff;
-                    memset(state->packet.payload, 0, 128);
-                    state->packet.crc = htons(crc(state->packet.payload, 128));
-                    state->packet_idx = 0;
-                    state->state = YMODEM_EOT;
-                    fclose(state->input);
-                } else {
-                    state->packet.type = 1;
-                    state->packet.seqno++;
-                    state->packet.seqcpl = ~state->packet.seqno;
-                    state->packet.crc = htons(crc(state->packet.payload, 128));
-                    state->packet_idx = 0;
-                    state->state = YMODEM_FILEDATA;
-                }
-            }
-            break;
-        case YMODEM_DATA_ACK:
-            if (input == 6) {
-                memset(state->packet.payload, 0x1a, 128);
-                ssize_t rx = fread(state->packet.payload, 1, 128, state->input);
-                printf("read %ld bytes from input\n", rx); fflush(stdout);
-                if (rx <= 0) {
-                    state->packet.type = 1;
-                    state->packet.seqno = 0;
-                    state->packet.seqcpl = 0xff;
-                    memset(state->packet.payload, 0, 128);
-                    state->packet.crc = htons(crc(state->packet.payload, 128));
-                    state->packet_idx = 0;
-                    state->state = YMODEM_EOT;
-                    fclose(state->input);
-                } else {
-                    state->packet.type = 1;
-                    state->packet.seqno++;
-                    state->packet.seqcpl = ~state->packet.seqno;
-                    state->packet.crc = htons(crc(state->packet.payload, 128));
-                    state->packet_idx = 0;
-                    state->state = YMODEM_FILEDATA;
-                }
-            } else if (input == 0x15) {
-                state->packet_idx = 0;
-                state->state = YMODEM_FILEDATA;
-            }
-            break;
-        case YMODEM_EOT_ACK:
-            if (input == 6)
-                state->state = YMODEM_FINAL_C;
-            else if (input == 0x15)
-                state->state = YMODEM_EOT;
-            break;
-        case YMODEM_FINAL_C:
-            if (input == 'C')
-                state->state = YMODEM_TERMINATING;
-            break;
-        case YMODEM_FINAL_ACK:
-            if (input == 6)
-                return 0;
-            else if (input == 0x15)
-                state->state = YMODEM_TERMINATING;
-            break;
-    }
-
-    return 1;
-}
-
-void ymodem_output(ymodem_state *state, int fd)
-{
-
-    uint8_t *buffer = (uint8_t *)&state->packet;
-    uint8_t output;
-
-    switch (state->state) {
-        case YMODEM_METADATA:
-            if (write(fd, buffer + state->packet_idx, 1) == 1) {
-                if (++(state->packet_idx) == sizeof(ym_packet)) {
-                    state->packet_idx = 0;      // reset to zero in case of retransmit
-                    state->state = YMODEM_META_ACK;
-                }
-            }
-            break;
-        case YMODEM_FILEDATA:
-            if (write(fd, buffer + state->packet_idx, 1) == 1) {
-                if (++(state->packet_idx) == sizeof(ym_packet)) {
-                    state->packet_idx = 0;      // reset to zero in case of retransmit
-                    state->state = YMODEM_DATA_ACK;
-                }
-            }
-            break;
-        case YMODEM_EOT:
-            output = 4;
-            if (write(fd, &output, 1) == 1) {
-                state->state = YMODEM_EOT_ACK;
-            }
-            break;
-        case YMODEM_TERMINATING:
-            if (write(fd, buffer + state->packet_idx, 1) == 1) {
-                if (++(state->packet_idx) == sizeof(ym_packet)) {
-                    state->packet_idx = 0;      // reset to zero in case of retransmit
-                    state->state = YMODEM_FINAL_ACK;
-                }
-            }
-            break;
-    }
-
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw_settings);
+    session_hold(prompt_session, 0);
 }
 
-// attempt to open a file for ymodem transmit, returns 1 if successful
-int ymodem_open(ymodem_state *state, char *filename)
+// a transfer that ends while the prompt is open prints its summary across the line being edited: once it's out,
+// put the prompt and the line back underneath
+static void prompt_refresh(int *last_state)
 {
-    state->input = fopen(filename, "r");
-
-    char *name = basename(filename);
-
-    if (!state->input) {
-        perror("fopen");
-        return 0;
+    if (prompting && *last_state != STATE_CONSOLEIO && prompt_session->state == STATE_CONSOLEIO) {
+        fflush(stdout);
+        rl_on_new_line();
+        rl_redisplay();
     }
-
-    state->state = YMODEM_WAIT_C;
-    state->packet.type = 1;
-    state->packet.seqno = 0;
-    state->packet.seqcpl = 0xff;
-    memset(state->packet.payload, 0, 128);
-    strncpy((char *)state->packet.payload, name, 128);
-    state->packet.crc = htons(crc(state->packet.payload, 128));
-    printf("metadata packet crc = %04x\n", state->packet.crc);
-    state->packet_idx = 0;
-
-    return 1;
+    *last_state = prompt_session->state;
 }
 
 char **files_only(const char *text, int start, int end)
@@ -234,233 +72,215 @@ char **files_only(const char *text, int start, int end)
 
 int main(int argc, const char * argv[])
 {
-    if (argc != 2)
+    long baud = 57600;
+    char **script = calloc(argc, sizeof(char *));
+    int script_count = 0;
+    int script_exit = 0;
+    const char *capture_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, (char * const *)argv, "b:c:xl:r:")) != -1) {
+        switch (opt) {
+            case 'b':
+                baud = strtol(optarg, NULL, 10);
+                break;
+            case 'c':
+                script[script_count++] = optarg;
+                break;
+            case 'x':
+                script_exit = 1;
+                break;
+            case 'l':
+                capture_path = optarg;
+                break;
+            case 'r':
+                // replaying a capture needs no device
+                return capture_replay(optarg, STDOUT_FILENO) == 0 ? 0 : 1;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    int device_count = argc - optind;
+    if (argc == 0 || device_count < 1 || device_count > MAX_DEVICES || baud <= 0)
     {
-        fprintf(stderr, "usage: %s <device>\n", argv[0]);
+        fprintf(stderr, "usage: %s [-b baud] [-c command]... [-x] [-l capture] <device>...\n"
+                        "       %s -r capture\n", argv[0], argv[0]);
         return 1;
     }
 
+    // several devices run headless: no console, just the commands on each, then a report
+    int headless = device_count > 1;
+    if (headless) script_exit = 1;
+
     rl_readline_name = "trs20comm";
     rl_attempted_completion_function = files_only;
-
-    const char *device = argv[1];
-    int fd = open_device(device, B57600);
+    rl_catch_signals = 0;
 
     struct termios config;
     struct termios stdin_settings;
-    tcgetattr(STDIN_FILENO, &config);
-    stdin_settings = config;
-    signal(SIGINT, sigint);
-    signal(SIGQUIT, sigint);
-    config.c_lflag &=(~ICANON & ~ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &config);
-
-    int kq = kqueue();
-    struct kevent evset[3];
-    EV_SET(&evset[0], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, NULL);
-    EV_SET(&evset[1], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-    EV_SET(&evset[2], STDIN_FILENO, EVFILT_READ, EV_ADD, 0, 0, NULL);
-    kevent(kq, evset, 3, NULL, 0, NULL);
-
-    int state = STATE_CONSOLEIO;
+    if (!headless) {
+        tcgetattr(STDIN_FILENO, &config);
+        stdin_settings = config;
+        config.c_lflag &=(~ICANON & ~ECHO);
+        tcsetattr(STDIN_FILENO, TCSANOW, &config);
+        raw_settings = config;
+    }
 
-    char console_buffer[1024];
-    size_t console_idx = 0;
+    // stdin is read a byte at a time, so it stays level-triggered
+    evloop *loop = evl_open();
+    if (!loop) {
+        perror("can't create event loop");
+        return 1;
+    }
+    int interactive = !headless && evl_add_fd(loop, STDIN_FILENO, 0) == 0;
+    int stdin_paused = 0;
+    evl_add_signal(loop, SIGINT);
+    evl_add_signal(loop, SIGQUIT);
+
+    double started = stats_now();
+    device *devices = calloc(device_count, sizeof(device));
+    for (int i = 0; i < device_count; i++) {
+        if (!session_open(&devices[i].s, loop, argv[optind + i], baud, i)) {
+            if (!headless) {
+                tcsetattr(STDIN_FILENO, TCSANOW, &stdin_settings);
+                return 1;
+            }
+            device_out(&devices[i], "can't open device");
+            continue;
+        }
+        devices[i].s.echo = !headless;
+        if (capture_path) {
+            // one log per device, numbered when there are several
+            char path[1024];
+            if (headless) {
+                snprintf(path, sizeof(path), "%s.%d", capture_path, i);
+            } else {
+                snprintf(path, sizeof(path), "%s", capture_path);
+            }
+            if (!session_capture(&devices[i].s, path)) return 1;
+        }
+    }
+    session *s = &devices[0].s;
+    prompt_session = s;
 
-    // transmitting a patchfile
-    char patch_data[1024];
-    size_t patch_idx = 0;
-    ssize_t patch_size = 0;
-    int patch_state;
-    char patch_preamble[3] = { 0x01, 0x00, 0xff };
-    int patch_preidx = 0;
+    evl_event evList[32];
+    int quitit = 0;
+    int prompt_state = s->state;
+    while (!quitit) {
+        // -c commands run in order on each device, each once the transfer before it is over
+        int running = 0;
+        for (int i = 0; i < device_count; i++) {
+            device *d = &devices[i];
+            if (d->hungup) continue;
+            for (;;) {
+                if (d->s.state == STATE_CONSOLEIO && d->script_idx < script_count) {
+                    char *line = strdup(script[d->script_idx++]);
+                    if (headless) printf("%s: ", d->s.device);
+                    printf("COMM> %s\n", line);
+                    if (!session_command(&d->s, line)) d->script_failed++;
+                    free(line);
+                }
 
-    ymodem_state ym;
+                // a transfer can finish in the output pass, so check for more to do before waiting
+                session_output(&d->s);
+                if (d->s.state != STATE_CONSOLEIO || d->script_idx == script_count) break;
+            }
+            if (d->script_idx == script_count && d->s.state == STATE_CONSOLEIO && session_console_queued(&d->s) == 0) {
+                if (!d->finished) d->finished = stats_now();
+            } else {
+                running++;
+            }
+        }
+        if (script_exit && running == 0) break;
+        prompt_refresh(&prompt_state);
+
+        // a paste the console ring can't take yet waits in the terminal rather than being dropped
+        if (interactive && !prompting && (session_console_queued(s) == CONSOLE_RING) != stdin_paused) {
+            stdin_paused = !stdin_paused;
+            if (stdin_paused) {
+                evl_remove_fd(loop, STDIN_FILENO);
+            } else {
+                evl_add_fd(loop, STDIN_FILENO, 0);
+            }
+        }
 
-    struct kevent evList[32];
-    int write_state = EV_DISABLE;
-    int write_change = EV_DISABLE;
-    int write_enable = 0;
-    int write_disable = 0;
-    while (!quitit) {
-        int changes = 0;
-        if (write_state != write_change) {
-            EV_SET(&evset[0], fd, EVFILT_WRITE, EV_ADD | write_change, 0, 0, NULL);
-            changes = 1;
-            write_state = write_change;
+        int nev = evl_wait(loop, evList, 32);
+        if (nev < 0) {
+            perror("event loop");
+            break;
         }
-        int nev = kevent(kq, evset, changes, evList, 32, NULL);
 
         for (int i = 0; i < nev; i++) {
-            if (evList[i].ident == STDIN_FILENO) {
+            if (evList[i].filter == EVL_SIGNAL) {
+                quitit = 1;
+            } else if (evList[i].filter == EVL_TIMER) {
+                if (evList[i].ident < device_count) session_timer(&devices[evList[i].ident].s);
+            } else if (interactive && evList[i].ident == STDIN_FILENO) {
+                if (prompting) {
+                    rl_callback_read_char();
+                    continue;
+                }
                 char input;
-                if (read(STDIN_FILENO, &input, 1) == 1) {
+                ssize_t count = read(STDIN_FILENO, &input, 1);
+                if (count == 0) {
+                    // stdin closed, carry on with just the device
+                    evl_remove_fd(loop, STDIN_FILENO);
+                    interactive = 0;
+                } else if (count == 1) {
                     if (input == '~') {
+                        // hold device output back until the command is in, so it doesn't land in the middle of it
                         printf("\n"); fflush(stdout);
+                        session_hold(s, 1);
                         tcsetattr(STDIN_FILENO, TCSANOW, &stdin_settings);
-                        char *input = readline("COMM> ");
-                        if (input) {
-                            if (*input) {
-                                add_history(input);
-                                if (strncmp(input, "p ", 2) == 0) {
-                                    if (state == STATE_CONSOLEIO) {
-                                        struct stat filestat;
-                                        if (stat(input+2, &filestat) != 0) {
-                                            perror("stat");
-                                            continue;
-                                        }
-                                        if ((filestat.st_mode & S_IFREG) == 0) {
-                                            fprintf(stderr, "patchfile must be a regular file\n");
-                                            continue;
-                                        }
-                                        if (filestat.st_size > 1024) {
-                                            fprintf(stderr, "patchfile must be at most 1024 bytes\n");
-                                            continue;
-                                        }
-                                        if (filestat.st_size == 0) {
-                                            fprintf(stderr, "patchfile is empty - nothing to transmit\n");
-                                            continue;
-                                        }
-                                        FILE *f = fopen(input+2, "r");
-                                        if (!f) {
-                                            perror("open");
-                                            continue;
-                                        }
-                                        patch_size = fread(patch_data, 1, 1024, f);
-                                        fclose(f);
-                                        if (patch_size < 0) {
-                                            perror("fread");
-                                            continue;
-                                        }
-                                        if (patch_size == 0) {
-                                            fprintf(stderr, "unable to read all of file input, aborting\n");
-                                            continue;
-                                        }
-                                        patch_preamble[0] = patch_size <= 128 ? 1 : 2;
-                                        state = STATE_PATCHING;
-                                        patch_state = PATCH_Y;
-                                        patch_idx = 0;
-                                        printf("Beginning patch upload: %ld bytes\n", patch_size);
-                                        write_change = EV_ENABLE;
-                                    } else {
-                                        printf("Unable to patch: transfer in progress\n");
-                                    }
-                                } else if (strncmp(input, "y ", 2) == 0) {
-                                    if (state == STATE_CONSOLEIO) {
-                                        if (ymodem_open(&ym, input+2)) {
-                                            printf("YModem transfer start\n");
-                                            write_change = EV_ENABLE;
-                                            state = STATE_YMODEM;
-                                        }
-                                    } else {
-                                        printf("Unable to transfer: transfer already in progress\n");
-                                    }
-                                }
-                            }
-                            free(input);
-                        }
-                        tcsetattr(STDIN_FILENO, TCSANOW, &config);
+                        prompting = 1;
+                        rl_callback_handler_install("COMM> ", command_line);
                     } else {
-                        // bung it in the console output buffer for writing to the device
-                        if (console_idx < 1024) {
-                            console_buffer[console_idx++] = input;
-                            write_change = EV_ENABLE;
-                        } else {
-                            char bel = 7;
-                            write(STDOUT_FILENO, &bel, 1);
-                        }
+                        session_key(s, input);
                     }
                 }
             } else {
-                if (evList[i].flags & EV_EOF) {
-                    printf("\n\nEOF on TTY device\n");
-                    quitit = 1;
-                } else if (evList[i].filter == EVFILT_READ) {
-                    char input;
-                    while (read(fd, &input, 1) == 1) {
-                        if (state == STATE_PATCHING && patch_state == PATCH_WAIT) {
-                            // any old input will do - terminate the transfer now
-                            patch_state = PATCH_ABORT;
-                            patch_preidx = 0;
-                        }
-                        if (state == STATE_YMODEM && !ymodem_input(&ym, input)) {
-                            if (console_idx == 0) write_change = EV_DISABLE;
-                            state = STATE_CONSOLEIO;
-                        }
-                        if (isprint(input) || input == 13 || input == 10 || input == 8) {
-                            write(STDOUT_FILENO, &input, 1);
-                        } else {
-                            char msg[5];
-                            sprintf(msg, "<%02x>", input & 0xff);
-                            write(STDOUT_FILENO, msg, 4);
-                        }
-                        usleep(100);
-                    }
-                } else if (evList[i].filter == EVFILT_WRITE) {
-                    char byte;
-                    ssize_t sent;
-                    switch (state) {
-                        case STATE_CONSOLEIO:
-                            if (console_idx > 0 && write(fd, console_buffer, 1) == 1) {
-                                console_idx--;
-                                memcpy(console_buffer, console_buffer+1, console_idx);
-                                if (console_idx == 0) write_change = EV_DISABLE;
-                            }
-                            break;
-                        case STATE_YMODEM:
-                            ymodem_output(&ym, fd);
-                            break;
-                        case STATE_PATCHING:
-                            switch (patch_state) {
-                                case PATCH_Y:
-                                    byte = 'y';
-                                    if (write(fd, &byte, 1) == 1) {
-                                        patch_state = PATCH_PREAMBLE;
-                                        patch_preidx = 0;
-                                        usleep(50000);
-                                    }
-                                    break;
-                                case PATCH_PREAMBLE:
-                                    if (write(fd, patch_preamble + patch_preidx, 1) == 1) {
-                                        byte = 'P';
-                                        write(STDOUT_FILENO, &byte, 1);
-                                        usleep(25000);
-                                        if (++patch_preidx == 3) {
-                                            patch_state = PATCH_XMIT;
-                                        }
-                                    }
-                                    break;
-                                case PATCH_XMIT:
-                                    if (write(fd, patch_data + patch_idx, 1) == 1) {
-                                        byte = '.';
-                                        write(STDOUT_FILENO, &byte, 1);
-                                        usleep(5000);
-                                        if (++patch_idx == patch_size) {
-                                            patch_state = PATCH_WAIT;
-                                        }
-                                    }
-                                    break;
-                                case PATCH_ABORT:
-                                    byte = 0x18;
-                                    if (write(fd, &byte, 1) == 1) {
-                                        byte = 'X';
-                                        write(STDOUT_FILENO, &byte, 1);
-                                        usleep(5000);
-                                        if (++patch_preidx > 1) {
-                                            state = STATE_CONSOLEIO;
-                                            if (console_idx == 0) write_change = EV_DISABLE;
-                                        }
-                                    }
-                                    break;
-                            }
+                device *d = NULL;
+                for (int j = 0; j < device_count; j++) {
+                    if (devices[j].s.fd == evList[i].ident) d = &devices[j];
+                }
+                if (!d || d->hungup) continue;
+                if (evList[i].eof) {
+                    if (!headless) {
+                        printf("\n\nEOF on TTY device\n");
+                        quitit = 1;
+                    } else {
+                        evl_remove_fd(loop, d->s.fd);
+                        device_out(d, "EOF on TTY device");
                     }
+                } else if (evList[i].filter == EVL_READ) {
+                    session_read(&d->s);
                 }
             }
         }
+        prompt_refresh(&prompt_state);
     }
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &stdin_settings);
-    close(fd);
+    if (prompting) rl_callback_handler_remove();
+    if (interactive) tcsetattr(STDIN_FILENO, TCSANOW, &stdin_settings);
+    int failed = 0;
+    if (headless) printf("\n%-24s %-8s %8s\n", "device", "result", "seconds");
+    for (int i = 0; i < device_count; i++) {
+        device *d = &devices[i];
+        // headless, a device interrupted before its commands ran out hasn't been flashed
+        int device_failed = d->script_failed || d->s.failures || d->hungup || (headless && !d->finished);
+        if (headless) {
+            printf("%-24s %-8s %8.1f\n", d->s.device, device_failed ? "FAILED" : "ok",
+                   (d->finished ? d->finished : stats_now()) - started);
+        }
+        failed += device_failed;
+        session_close(&d->s);
+    }
+    if (headless) {
+        printf("%d of %d devices ok in %.1fs\n", device_count - failed, device_count, stats_now() - started);
+    }
+    evl_close(loop);
+    free(devices);
+    free(script);
 
-    return 0;
+    return failed ? 2 : 0;
 }
@@ -0,0 +1,997 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <wordexp.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trs20.h"
+#include "image.h"
+#include "console.h"
+#include "session.h"
+
+// devices open on the loop; low latency mode's drain holds the loop, so it's only for a single one
+static int sessions_open;
+
+int session_open(session *s, evloop *loop, const char *device, long baud, int timer)
+{
+    memset(s, 0, sizeof(session));
+    s->device = device;
+    s->baud = baud;
+    s->fd = open_device(device, baud);
+    s->loop = loop;
+    s->timer = timer;
+    s->state = STATE_CONSOLEIO;
+    s->echo = 1;
+    s->patch_preamble[0] = 0x01;
+    s->patch_preamble[1] = 0x00;
+    s->patch_preamble[2] = 0xff;
+    s->patch_gap = PATCH_GAP_DEFAULT;
+
+    if (s->fd < 0) return 0;
+
+    // the device is drained on every wakeup so it can be edge-triggered
+    evl_add_fd(loop, s->fd, EVL_EDGE);
+    sessions_open++;
+    return 1;
+}
+
+// remove the files written for the segments of the last batch
+static void session_segments_clean(session *s)
+{
+    if (!s->segment_dir[0]) return;
+    DIR *dir = opendir(s->segment_dir);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[sizeof(s->segment_dir) + 256];
+        snprintf(path, sizeof(path), "%s/%s", s->segment_dir, entry->d_name);
+        unlink(path);
+    }
+    if (dir) closedir(dir);
+    rmdir(s->segment_dir);
+    s->segment_dir[0] = 0;
+}
+
+void session_close(session *s)
+{
+    session_capture_stop(s);
+    if (s->low_latency) low_latency_off(s->fd, s->device, &s->latency_saved);
+    if (s->state == STATE_YMODEM) {
+        ymodem_close(&s->ym);
+    }
+    if (s->state == STATE_ZMODEM) {
+        zmodem_close(&s->zm);
+    }
+    if (s->state == STATE_YRECEIVE) {
+        yreceive_close(&s->yr);
+    }
+    if (s->state == STATE_TEXT) {
+        image_unload(&s->text);
+    }
+    session_segments_clean(s);
+    if (s->timer_at) evl_set_timer(s->loop, s->timer, 0);
+    if (s->fd < 0) return;
+    evl_remove_fd(s->loop, s->fd);
+    close(s->fd);
+    sessions_open--;
+}
+
+int session_capture(session *s, const char *path)
+{
+    session_capture_stop(s);
+    s->capture = malloc(sizeof(capture));
+    if (!capture_open(s->capture, path)) {
+        free(s->capture);
+        s->capture = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void session_capture_stop(session *s)
+{
+    if (!s->capture) return;
+    capture_close(s->capture);
+    printf("capture: %llu bytes", (unsigned long long)s->capture->bytes);
+    if (s->capture->dropped) printf(", %llu dropped", (unsigned long long)s->capture->dropped);
+    printf("\n");
+    free(s->capture);
+    s->capture = NULL;
+}
+
+// write to the device, copying what went to the capture
+static ssize_t session_send(session *s, const void *data, size_t size)
+{
+    ssize_t sent = write(s->fd, data, size);
+    if (sent > 0 && s->capture) capture_put(s->capture, CAPTURE_TX, data, sent);
+    return sent;
+}
+
+size_t session_console_queued(const session *s)
+{
+    return s->console_tail - s->console_head;
+}
+
+// queue bytes for the device, all of them or none; returns 0 if the ring hasn't room
+static int console_put(session *s, const void *data, size_t size)
+{
+    if (CONSOLE_RING - session_console_queued(s) < size) return 0;
+    size_t at = s->console_tail & (CONSOLE_RING - 1);
+    size_t first = CONSOLE_RING - at < size ? CONSOLE_RING - at : size;
+    memcpy(s->console_ring + at, data, first);
+    memcpy(s->console_ring, (const uint8_t *)data + first, size - first);
+    s->console_tail += size;
+    return 1;
+}
+
+// write what the tty will take from the ring, returns 1 if some is left for later
+static int console_flush(session *s)
+{
+    while (s->console_head != s->console_tail) {
+        size_t at = s->console_head & (CONSOLE_RING - 1);
+        size_t run = CONSOLE_RING - at;
+        if (run > session_console_queued(s)) run = session_console_queued(s);
+        ssize_t sent = session_send(s, s->console_ring + at, run);
+        if (sent <= 0) return 1;
+        s->console_head += sent;
+        if ((size_t)sent < run) return 1;
+    }
+    return 0;
+}
+
+// read a raw patchfile into patch_data; returns 1 if successful
+static int session_patch_file(session *s, const char *path)
+{
+    struct stat filestat;
+    if (stat(path, &filestat) != 0) {
+        perror("stat");
+        return 0;
+    }
+    if ((filestat.st_mode & S_IFREG) == 0) {
+        fprintf(stderr, "patchfile must be a regular file\n");
+        return 0;
+    }
+    if (filestat.st_size > 1024) {
+        fprintf(stderr, "patchfile must be at most 1024 bytes\n");
+        return 0;
+    }
+    if (filestat.st_size == 0) {
+        fprintf(stderr, "patchfile is empty - nothing to transmit\n");
+        return 0;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("open");
+        return 0;
+    }
+    s->patch_size = fread(s->patch_data, 1, 1024, f);
+    fclose(f);
+    if (s->patch_size < 0) {
+        perror("fread");
+        return 0;
+    }
+    if (s->patch_size == 0) {
+        fprintf(stderr, "unable to read all of file input, aborting\n");
+        return 0;
+    }
+    return 1;
+}
+
+// a HEX, S-record or ELF patch has to be a single range, which is what goes to the bootrom
+static int session_patch_image(session *s, const char *path)
+{
+    image_segment *segments;
+    int count = image_segments(path, &segments);
+    if (count < 0) return 0;
+    if (count != 1 || segments[0].size > 1024) {
+        fprintf(stderr, "patch must be one address range of at most 1024 bytes\n");
+        image_free_segments(segments, count);
+        return 0;
+    }
+    memcpy(s->patch_data, segments[0].data, segments[0].size);
+    s->patch_size = segments[0].size;
+    printf("patch loads at 0x%llx\n", (unsigned long long)segments[0].addr);
+    image_free_segments(segments, count);
+    return 1;
+}
+
+// the batch as files to send: raw files as they are, and HEX, S-record or ELF images as a file per populated
+// range, named <image>@<address>.bin, so the padding a flat binary would carry stays off the wire
+static char **session_batch(session *s, char **files, int *count)
+{
+    char **batch = NULL;
+    int batched = 0;
+    for (int i = 0; i < *count; i++) {
+        if (image_format(files[i]) == IMAGE_RAW) {
+            batch = realloc(batch, (batched + 1) * sizeof(char *));
+            batch[batched++] = strdup(files[i]);
+            continue;
+        }
+
+        image_segment *segments;
+        int segment_count = image_segments(files[i], &segments);
+        if (segment_count <= 0) {
+            if (segment_count == 0) fprintf(stderr, "%s: no data\n", files[i]);
+            goto fail;
+        }
+        if (!s->segment_dir[0]) {
+            const char *tmp = getenv("TMPDIR");
+            snprintf(s->segment_dir, sizeof(s->segment_dir), "%s/scomm-XXXXXX", tmp ? tmp : "/tmp");
+            if (!mkdtemp(s->segment_dir)) {
+                perror(s->segment_dir);
+                s->segment_dir[0] = 0;
+                image_free_segments(segments, segment_count);
+                goto fail;
+            }
+        }
+
+        char name[256];
+        snprintf(name, sizeof(name), "%s", basename(files[i]));
+        char *dot = strrchr(name, '.');
+        if (dot && dot != name) *dot = 0;
+        size_t total = 0;
+        for (int j = 0; j < segment_count; j++) {
+            char path[sizeof(s->segment_dir) + 300];
+            snprintf(path, sizeof(path), "%s/%s@%08llx.bin", s->segment_dir, name,
+                     (unsigned long long)segments[j].addr);
+            // x: two images with the same name and a range at the same address would otherwise collide
+            FILE *f = fopen(path, "wbx");
+            if (!f || fwrite(segments[j].data, 1, segments[j].size, f) != segments[j].size) {
+                perror(path);
+                if (f) fclose(f);
+                image_free_segments(segments, segment_count);
+                goto fail;
+            }
+            fclose(f);
+            batch = realloc(batch, (batched + 1) * sizeof(char *));
+            batch[batched++] = strdup(path);
+            total += segments[j].size;
+        }
+        printf("%s: %d address range%s, %zu bytes to send\n", files[i], segment_count,
+               segment_count == 1 ? "" : "s", total);
+        image_free_segments(segments, segment_count);
+    }
+    *count = batched;
+    return batch;
+
+fail:
+    for (int i = 0; i < batched; i++) free(batch[i]);
+    free(batch);
+    session_segments_clean(s);
+    return NULL;
+}
+
+static void session_batch_free(char **batch, int count)
+{
+    for (int i = 0; i < count; i++) free(batch[i]);
+    free(batch);
+}
+
+int session_command(session *s, char *line)
+{
+    if (strncmp(line, "p ", 2) == 0) {
+        // p [-a | -g <usec>] <file>: -g paces the patch bytes, -a finds the fastest pace the bootrom takes
+        char *path = line + 2;
+        long gap = s->patch_gap;
+        int calibrate = 0;
+        while (*path == '-') {
+            if (strncmp(path, "-a ", 3) == 0) {
+                calibrate = 1;
+                path += 3;
+            } else if (strncmp(path, "-g ", 3) == 0) {
+                gap = strtol(path + 3, &path, 10);
+            } else {
+                break;
+            }
+            while (*path == ' ') path++;
+        }
+        if (*path == 0 || *path == '-' || gap <= 0) {
+            fprintf(stderr, "usage: p [-a | -g <usec>] <file>\n");
+        } else if (s->state == STATE_CONSOLEIO) {
+            int loaded = image_format(path) == IMAGE_RAW ? session_patch_file(s, path) : session_patch_image(s, path);
+            if (!loaded) return 0;
+            s->patch_preamble[0] = s->patch_size <= 128 ? 1 : 2;
+            s->state = STATE_PATCHING;
+            s->patch_state = PATCH_Y;
+            s->patch_idx = 0;
+            s->patch_at = 0;
+            s->patch_calibrate = calibrate;
+            s->patch_gap = calibrate ? PATCH_GAP_MIN : gap;
+            printf("Beginning patch upload: %ld bytes, %ldus a byte%s\n", s->patch_size, s->patch_gap,
+                   calibrate ? " to start with" : "");
+            return 1;
+        } else {
+            printf("Unable to patch: transfer in progress\n");
+        }
+    } else if (strcmp(line, "b") == 0 || strncmp(line, "b ", 2) == 0) {
+        // b [<rate> [<target command>]]: the command goes to the target first, CR terminated
+        char *command;
+        long rate = strtol(line + 1, &command, 10);
+        while (*command == ' ') command++;
+        if (line[1] == 0) {
+            printf("line at %ld baud\n", s->baud);
+            return 1;
+        } else if (rate <= 0) {
+            fprintf(stderr, "usage: b [<rate> [<target command>]]\n");
+        } else if (s->state != STATE_CONSOLEIO) {
+            printf("Unable to change baud rate: transfer in progress\n");
+        } else if (*command) {
+            size_t len = strlen(command);
+            if (CONSOLE_RING - session_console_queued(s) < len + 1) {
+                fprintf(stderr, "console output is backed up, try again\n");
+            } else {
+                console_put(s, command, len);
+                console_put(s, "\r", 1);
+                s->pending_baud = rate;
+                return 1;
+            }
+        } else if (set_baud(s->fd, rate) == 0) {
+            s->baud = rate;
+            printf("line now at %ld baud\n", s->baud);
+            return 1;
+        }
+    } else if (strncmp(line, "y ", 2) == 0) {
+        // y [-k] [-j <json>] <file|glob>...: -k selects YModem-1K data blocks, -j writes a transfer summary
+        int ok = 0;
+        wordexp_t words;
+        if (wordexp(line + 2, &words, WRDE_NOCMD) != 0) {
+            fprintf(stderr, "can't parse file list\n");
+            return 0;
+        }
+        char **files = words.we_wordv;
+        int count = words.we_wordc;
+        size_t block_size = YM_BLOCK;
+        const char *json_path = NULL;
+        while (count > 0 && files[0][0] == '-') {
+            if (strcmp(files[0], "-k") == 0) {
+                block_size = YM_BLOCK_1K;
+            } else if (strcmp(files[0], "-j") == 0 && count > 1) {
+                json_path = *++files;
+                count--;
+            } else {
+                break;
+            }
+            files++;
+            count--;
+        }
+        if (count == 0) {
+            fprintf(stderr, "usage: y [-k] [-j <json>] <file>...\n");
+        } else if (s->state == STATE_CONSOLEIO) {
+            char **batch = session_batch(s, files, &count);
+            if (batch && ymodem_open(&s->ym, batch, count, block_size, s->baud, json_path)) {
+                s->ym.stats.progress = s->echo && !s->hold;
+                s->ym.drain = s->low_latency;
+                printf("YModem%s transfer start\n", block_size == YM_BLOCK_1K ? "-1K" : "");
+                s->state = STATE_YMODEM;
+                ok = 1;
+            } else {
+                session_segments_clean(s);
+            }
+            if (batch) session_batch_free(batch, count);
+        } else {
+            printf("Unable to transfer: transfer already in progress\n");
+        }
+        wordfree(&words);
+        return ok;
+    } else if (strncmp(line, "z ", 2) == 0) {
+        // z [-r] [-j <json>] <file|glob>...: -r resumes files the receiver already has part of
+        int ok = 0;
+        wordexp_t words;
+        if (wordexp(line + 2, &words, WRDE_NOCMD) != 0) {
+            fprintf(stderr, "can't parse file list\n");
+            return 0;
+        }
+        char **files = words.we_wordv;
+        int count = words.we_wordc;
+        int resume = 0;
+        const char *json_path = NULL;
+        while (count > 0 && files[0][0] == '-') {
+            if (strcmp(files[0], "-r") == 0) {
+                resume = 1;
+            } else if (strcmp(files[0], "-j") == 0 && count > 1) {
+                json_path = *++files;
+                count--;
+            } else {
+                break;
+            }
+            files++;
+            count--;
+        }
+        if (count == 0) {
+            fprintf(stderr, "usage: z [-r] [-j <json>] <file>...\n");
+        } else if (s->state == STATE_CONSOLEIO) {
+            char **batch = session_batch(s, files, &count);
+            if (batch && zmodem_open(&s->zm, batch, count, resume, s->baud, json_path)) {
+                s->zm.stats.progress = s->echo && !s->hold;
+                printf("ZModem transfer start\n");
+                s->state = STATE_ZMODEM;
+                ok = 1;
+            } else {
+                session_segments_clean(s);
+            }
+            if (batch) session_batch_free(batch, count);
+        } else {
+            printf("Unable to transfer: transfer already in progress\n");
+        }
+        wordfree(&words);
+        return ok;
+    } else if (strncmp(line, "t ", 2) == 0) {
+        // t [-d <ms>] [-w <prompt>] <file>: type a text file at the device, pacing each line if asked
+        int ok = 0;
+        wordexp_t words;
+        if (wordexp(line + 2, &words, WRDE_NOCMD) != 0) {
+            fprintf(stderr, "can't parse text command\n");
+            return 0;
+        }
+        char **args = words.we_wordv;
+        int count = words.we_wordc;
+        long delay = 0;
+        const char *prompt = "";
+        struct stat filestat;
+        while (count > 1 && args[0][0] == '-') {
+            if (strcmp(args[0], "-d") == 0) {
+                delay = strtol(args[1], NULL, 10) * 1000;
+            } else if (strcmp(args[0], "-w") == 0) {
+                prompt = args[1];
+            } else {
+                break;
+            }
+            args += 2;
+            count -= 2;
+        }
+        if (count != 1 || args[0][0] == '-' || delay < 0 || strlen(prompt) >= sizeof(s->text_prompt)) {
+            fprintf(stderr, "usage: t [-d <ms>] [-w <prompt>] <file>\n");
+        } else if (s->state != STATE_CONSOLEIO) {
+            printf("Unable to send text: transfer in progress\n");
+        } else if (image_load(&s->text, args[0], &filestat)) {
+            s->text_offset = 0;
+            s->text_delay = delay;
+            snprintf(s->text_prompt, sizeof(s->text_prompt), "%s", prompt);
+            s->text_wait = TEXT_SENDING;
+            s->text_at = 0;
+            s->text_line_len = 0;
+            s->text_lines = 0;
+            s->text_started = stats_now();
+            s->state = STATE_TEXT;
+            ok = 1;
+        }
+        wordfree(&words);
+        return ok;
+    } else if (strcmp(line, "g") == 0 || strncmp(line, "g ", 2) == 0) {
+        // g [-j <json>] [<dir>]: receive a YModem batch into dir, the current directory by default
+        int ok = 0;
+        wordexp_t words;
+        if (wordexp(line + 1, &words, WRDE_NOCMD) != 0) {
+            fprintf(stderr, "can't parse directory\n");
+            return 0;
+        }
+        char **args = words.we_wordv;
+        int count = words.we_wordc;
+        const char *json_path = NULL;
+        if (count > 1 && strcmp(args[0], "-j") == 0) {
+            json_path = args[1];
+            args += 2;
+            count -= 2;
+        }
+        if (count > 1 || (count == 1 && args[0][0] == '-')) {
+            fprintf(stderr, "usage: g [-j <json>] [<dir>]\n");
+        } else if (s->state == STATE_CONSOLEIO) {
+            s->yr.stats.progress = s->echo && !s->hold;
+            if (yreceive_open(&s->yr, count ? args[0] : ".", json_path)) {
+                printf("YModem receive start\n");
+                s->state = STATE_YRECEIVE;
+                ok = 1;
+            }
+        } else {
+            printf("Unable to transfer: transfer already in progress\n");
+        }
+        wordfree(&words);
+        return ok;
+    } else if (strcmp(line, "l") == 0 || strcmp(line, "l on") == 0 || strcmp(line, "l off") == 0) {
+        // l [on|off]: low latency mode, and the receiver turnaround it's making
+        if (strcmp(line, "l on") == 0 && !s->low_latency && sessions_open > 1) {
+            // a packet's drain would stall the other devices for its time on the wire
+            printf("low latency mode drains each packet with the loop held, so it's for one device only\n");
+            return 0;
+        } else if (strcmp(line, "l on") == 0 && !s->low_latency) {
+            int took = low_latency_on(s->fd, s->device, &s->latency_saved);
+            printf("low latency on: ASYNC_LOW_LATENCY %s, rx FIFO trigger %s, latency timer %s, packets drained\n",
+                   took & LATENCY_ASYNC ? "set" : "not supported", took & LATENCY_FIFO ? "1 byte" : "not supported",
+                   took & LATENCY_TIMER ? "1ms" : "not supported");
+            s->turnaround_before = s->turnaround;
+            s->low_latency = 1;
+        } else if (strcmp(line, "l off") == 0 && s->low_latency) {
+            low_latency_off(s->fd, s->device, &s->latency_saved);
+            s->low_latency = 0;
+        } else {
+            printf("low latency %s", s->low_latency ? "on" : "off");
+            if (s->turnaround) printf(", last turnaround %.1fms", s->turnaround * 1e3);
+            if (s->low_latency && s->turnaround_before) printf(", %.1fms before", s->turnaround_before * 1e3);
+            printf("\n");
+        }
+        return 1;
+    } else if (strcmp(line, "c") == 0 || strncmp(line, "c ", 2) == 0) {
+        // c [<file>]: capture traffic to file and file.txt, or with no file stop capturing
+        char *path = line + 1;
+        while (*path == ' ') path++;
+        if (*path == 0) {
+            if (!s->capture) printf("not capturing\n");
+            session_capture_stop(s);
+            return 1;
+        }
+        if (session_capture(s, path)) {
+            printf("capturing to %s\n", path);
+            return 1;
+        }
+        return 0;
+    } else if (strncmp(line, "r ", 2) == 0) {
+        // r <file>: show the device output in a capture, as the console did
+        char *path = line + 2;
+        while (*path == ' ') path++;
+        return capture_replay(path, STDOUT_FILENO) == 0;
+    }
+
+    fprintf(stderr, "unknown command: %s\n", line);
+    return 0;
+}
+
+int session_key(session *s, char input)
+{
+    // bung it in the console ring for writing to the device
+    if (console_put(s, &input, 1)) return 1;
+    char bel = 7;
+    write(STDOUT_FILENO, &bel, 1);
+    return 0;
+}
+
+// wait usec before the patch upload moves on; the session timer ends the wait
+static void session_patch_pace(session *s, long usec)
+{
+    s->patch_at = stats_now() + usec / 1e6;
+}
+
+// the patch went in, or calibration gave up: finish by cancelling whatever receiver is running
+static void session_patch_cancel(session *s)
+{
+    s->patch_state = PATCH_ABORT;
+    s->patch_preidx = 0;
+    s->patch_at = 0;
+}
+
+// the 'y' started the bootrom receiver again, so the patch didn't take: go again, slower, into that receiver
+static void session_patch_slower(session *s)
+{
+    long gap = s->patch_gap * 3 / 2;
+    if (gap > PATCH_GAP_MAX) {
+        printf("\nno pace up to %dus got the patch in, giving up\n", PATCH_GAP_MAX);
+        s->failures++;
+        s->patch_calibrate = 0;
+        session_patch_cancel(s);
+        return;
+    }
+    printf("\nthe bootrom is still receiving, trying %ldus a byte\n", gap);
+    s->patch_gap = gap;
+    s->patch_state = PATCH_PREAMBLE;
+    s->patch_preidx = 0;
+    s->patch_idx = 0;
+    s->patch_at = 0;
+}
+
+static void session_patch_input(session *s, uint8_t input)
+{
+    if (s->patch_state == PATCH_WAIT) {
+        // any old input will do - terminate the transfer now
+        s->patch_state = PATCH_ABORT;
+        s->patch_preidx = 0;
+        s->patch_at = 0;
+    } else if (s->patch_state == PATCH_PROBE && s->patch_preidx <= 1 && (input == 'C' || input == 'G')) {
+        // a receiver is polling, already or after the 'y'; the bootrom's polls with C too, so see if it takes an
+        // empty block 0 at the line rate
+        s->patch_preidx = 2;
+        s->patch_idx = 0;
+        s->patch_at = 0;
+    } else if (s->patch_state == PATCH_PROBE && s->patch_preidx == 3 && input == 6) {
+        // only the patched receiver keeps up; later uploads get a margin over the pace that just scraped through
+        printf("\npatched receiver took a block, the bootrom took %ldus a byte; using %ldus from now on\n",
+               s->patch_gap, s->patch_gap + s->patch_gap / 4);
+        s->patch_gap += s->patch_gap / 4;
+        s->patch_calibrate = 0;
+        session_patch_cancel(s);
+    } else if (s->patch_state == PATCH_PROBE && s->patch_preidx == 3 && input == 0x15) {
+        // the bootrom lost the block's header and NAKed it
+        session_patch_slower(s);
+    }
+}
+
+// a pacing wait is over, or the patch upload's wait for the target ran out
+static void session_patch_timer(session *s)
+{
+    s->patch_at = 0;
+    if (s->patch_state == PATCH_WAIT) {
+        // no NAK from the bootrom: cancel anyway, the patch is as in as it will be
+        s->patch_state = PATCH_ABORT;
+        s->patch_preidx = 0;
+    } else if (s->patch_state == PATCH_PROBE && (s->patch_preidx == 1 || s->patch_preidx == 3)) {
+        // no receiver, or no answer to the block: the bootrom is most likely still waiting for one
+        session_patch_slower(s);
+    }
+}
+
+// send the next byte of the patch upload, once the bootrom has had time for the last; returns 1 if the tty is full
+static int session_patch_output(session *s)
+{
+    char byte;
+    if (s->patch_at) return 0;
+
+    switch (s->patch_state) {
+        case PATCH_Y:
+            byte = 'y';
+            if (session_send(s, &byte, 1) != 1) return 1;
+            s->patch_state = PATCH_PREAMBLE;
+            s->patch_preidx = 0;
+            session_patch_pace(s, PATCH_START_DELAY);
+            break;
+        case PATCH_PREAMBLE:
+            if (session_send(s, s->patch_preamble + s->patch_preidx, 1) != 1) return 1;
+            byte = 'P';
+            if (s->echo) write(STDOUT_FILENO, &byte, 1);
+            if (++s->patch_preidx == 3) {
+                s->patch_state = PATCH_XMIT;
+            }
+            session_patch_pace(s, PATCH_HEADER_GAP);
+            break;
+        case PATCH_XMIT:
+            if (session_send(s, s->patch_data + s->patch_idx, 1) != 1) return 1;
+            byte = '.';
+            if (s->echo) write(STDOUT_FILENO, &byte, 1);
+            if (++s->patch_idx == s->patch_size) {
+                s->patch_state = PATCH_WAIT;
+                session_patch_pace(s, PATCH_NAK_TIMEOUT);
+            } else {
+                session_patch_pace(s, s->patch_gap);
+            }
+            break;
+        case PATCH_ABORT:
+            byte = 0x18;
+            if (session_send(s, &byte, 1) != 1) return 1;
+            byte = 'X';
+            if (s->echo) write(STDOUT_FILENO, &byte, 1);
+            if (++s->patch_preidx <= 1) {
+                session_patch_pace(s, s->patch_gap);
+            } else if (s->patch_calibrate) {
+                // give the target a moment to leave the receiver, then see which one a 'y' starts
+                s->patch_state = PATCH_PROBE;
+                s->patch_preidx = 0;
+                session_patch_pace(s, PATCH_START_DELAY);
+            } else {
+                s->state = STATE_CONSOLEIO;
+            }
+            break;
+        case PATCH_PROBE:
+            if (s->patch_preidx == 0) {
+                byte = 'y';
+                if (session_send(s, &byte, 1) != 1) return 1;
+                s->patch_preidx = 1;
+                session_patch_pace(s, PATCH_PROBE_TIMEOUT);
+            } else if (s->patch_preidx == 2) {
+                // an empty block 0, which ends a batch that never started
+                uint8_t block[3 + 128 + 2] = { 0x01, 0x00, 0xff };
+                uint16_t sum = crc(block + 3, 128);
+                block[131] = sum >> 8;
+                block[132] = sum & 0xff;
+                ssize_t n = session_send(s, block + s->patch_idx, sizeof(block) - s->patch_idx);
+                if (n > 0) s->patch_idx += n;
+                if (s->patch_idx < sizeof(block)) return 1;
+                s->patch_preidx = 3;
+                session_patch_pace(s, PATCH_PROBE_TIMEOUT);
+            }
+            break;
+    }
+    return 0;
+}
+
+// a YModem batch is over, count it as a failure unless it ran to the final ACK
+static void session_ymodem_done(session *s)
+{
+    if (!s->ym.completed) s->failures++;
+    if (!s->echo) printf("%s: YModem batch %s\n", s->device, s->ym.completed ? "complete" : "failed");
+    ymodem_close(&s->ym);
+    if (s->ym.rtt_count) {
+        s->turnaround = s->ym.turn_sum / s->ym.rtt_count;
+        if (s->low_latency && s->turnaround_before) {
+            printf("turnaround %.1fms in low latency mode, %.1fms before it\n", s->turnaround * 1e3,
+                   s->turnaround_before * 1e3);
+        }
+    }
+    session_segments_clean(s);
+    s->state = STATE_CONSOLEIO;
+}
+
+// likewise for a ZModem batch, which completes when the receiver answers ZFIN
+static void session_zmodem_done(session *s)
+{
+    if (!s->zm.completed) s->failures++;
+    if (!s->echo) printf("%s: ZModem batch %s\n", s->device, s->zm.completed ? "complete" : "failed");
+    zmodem_close(&s->zm);
+    session_segments_clean(s);
+    s->state = STATE_CONSOLEIO;
+}
+
+// and for a receive, which completes on the empty block 0 once the writer has put it all on disk
+static void session_yreceive_done(session *s)
+{
+    yreceive_close(&s->yr);
+    if (!s->yr.completed) s->failures++;
+    if (!s->echo) printf("%s: YModem receive %s\n", s->device, s->yr.completed ? "complete" : "failed");
+    s->state = STATE_CONSOLEIO;
+}
+
+// a text file is all out, or its prompt never came
+static void session_text_done(session *s, int ok)
+{
+    double elapsed = stats_now() - s->text_started;
+    if (!ok) s->failures++;
+    if (s->echo) {
+        printf("\n%s: %u lines, %zu bytes in %.2fs\n", ok ? "text sent" : "text stopped", s->text_lines,
+               s->text_offset, elapsed);
+    } else {
+        printf("%s: text %s, %u lines in %.1fs\n", s->device, ok ? "sent" : "failed", s->text_lines, elapsed);
+    }
+    image_unload(&s->text);
+    s->text_at = 0;
+    s->state = STATE_CONSOLEIO;
+}
+
+// queue text up to the end of the next line, or as much of it as fits; returns 1 at the end of a line.
+// Lines end in CR, as Enter does on a terminal, whether the file has LF, CR LF or CR
+static int session_text_fill(session *s)
+{
+    uint8_t chunk[4096];
+    size_t room = CONSOLE_RING - session_console_queued(s);
+    size_t len = 0;
+    int eol = 0;
+    while (!eol && s->text_offset < s->text.size && len < sizeof(chunk) && len < room) {
+        uint8_t c = s->text.data[s->text_offset++];
+        if (c == '\r' && s->text_offset < s->text.size && s->text.data[s->text_offset] == '\n') continue;
+        eol = c == '\n' || c == '\r';
+        chunk[len++] = eol ? '\r' : c;
+    }
+    console_put(s, chunk, len);
+    s->text_line_len += len;
+    if (eol) s->text_lines++;
+    return eol;
+}
+
+// stream the text file through the console ring; returns 1 if the tty is full
+static int session_text_output(session *s)
+{
+    int paced = s->text_delay || s->text_prompt[0];
+    int blocked = console_flush(s);
+    for (;;) {
+        switch (s->text_wait) {
+            case TEXT_SENDING:
+                if (s->text_offset == s->text.size) {
+                    if (!blocked) session_text_done(s, 1);
+                    return blocked;
+                }
+                if (session_console_queued(s) == CONSOLE_RING) return blocked;
+                if (session_text_fill(s) && paced) {
+                    s->text_wait = TEXT_DRAIN;
+                    s->text_match = 0;
+                }
+                blocked = console_flush(s);
+                break;
+            case TEXT_DRAIN:
+                if (blocked) return 1;
+                if (s->text_prompt[0]) {
+                    s->text_wait = TEXT_PROMPT;
+                    s->text_at = stats_now() + TEXT_PROMPT_TIMEOUT;
+                } else {
+                    // the line is in the tty's hands, pause from when it's across the line
+                    s->text_wait = TEXT_PAUSE;
+                    s->text_at = stats_now() + s->text_line_len * 10.0 / s->baud + s->text_delay / 1e6;
+                }
+                s->text_line_len = 0;
+                break;
+            case TEXT_PROMPT:
+                if (s->text_match < strlen(s->text_prompt)) return 0;
+                if (s->text_delay) {
+                    s->text_wait = TEXT_PAUSE;
+                    s->text_at = stats_now() + s->text_delay / 1e6;
+                } else {
+                    s->text_wait = TEXT_SENDING;
+                    s->text_at = 0;
+                }
+                break;
+            case TEXT_PAUSE:
+                return 0;
+        }
+    }
+}
+
+// watch the device output for the prompt that lets the next line go
+static void session_text_input(session *s, uint8_t input)
+{
+    size_t len = strlen(s->text_prompt);
+    if (s->text_match == len) return;
+    if (input == (uint8_t)s->text_prompt[s->text_match]) {
+        s->text_match++;
+    } else {
+        s->text_match = input == (uint8_t)s->text_prompt[0];
+    }
+}
+
+static void session_text_timer(session *s)
+{
+    if (s->text_at == 0 || stats_now() < s->text_at) return;
+    s->text_at = 0;
+    if (s->text_wait == TEXT_PAUSE) {
+        s->text_wait = TEXT_SENDING;
+    } else if (s->text_wait == TEXT_PROMPT) {
+        printf("\nno \"%s\" after line %u\n", s->text_prompt, s->text_lines);
+        session_text_done(s, 0);
+    }
+}
+
+void session_hold(session *s, int hold)
+{
+    s->hold = hold;
+    s->ym.stats.progress = s->echo && !hold;
+    s->zm.stats.progress = s->echo && !hold;
+    s->yr.stats.progress = s->echo && !hold;
+    if (hold || s->held_len == 0) return;
+
+    char out[4 * 4096];
+    for (size_t i = 0; i < s->held_len; i += 4096) {
+        size_t size = s->held_len - i < 4096 ? s->held_len - i : 4096;
+        write_all(STDOUT_FILENO, out, console_render(s->held + i, size, out));
+    }
+    if (s->held_dropped) printf("\n[%zu bytes of device output not shown]\n", s->held_dropped);
+    s->held_len = 0;
+    s->held_dropped = 0;
+}
+
+void session_read(session *s)
+{
+    // drain everything the tty has, echo it in one write, then run it through the protocol
+    uint8_t rx[4096];
+    char out[4 * sizeof(rx)];
+    ssize_t count;
+    while ((count = read(s->fd, rx, sizeof(rx))) > 0) {
+        if (s->capture) capture_put(s->capture, CAPTURE_RX, rx, count);
+        // a file being received isn't for the terminal, the progress line stands in for it
+        int show = s->echo && s->state != STATE_YRECEIVE;
+        if (show && s->hold) {
+            size_t keep = sizeof(s->held) - s->held_len < (size_t)count ? sizeof(s->held) - s->held_len : (size_t)count;
+            memcpy(s->held + s->held_len, rx, keep);
+            s->held_len += keep;
+            s->held_dropped += count - keep;
+        } else if (show) {
+            write_all(STDOUT_FILENO, out, console_render(rx, count, out));
+        }
+        for (ssize_t j = 0; j < count; j++) {
+            if (s->state == STATE_PATCHING) {
+                session_patch_input(s, rx[j]);
+            }
+            if (s->state == STATE_YMODEM && !ymodem_input(&s->ym, rx[j])) {
+                session_ymodem_done(s);
+            }
+            if (s->state == STATE_ZMODEM && !zmodem_input(&s->zm, rx[j])) {
+                session_zmodem_done(s);
+            }
+            if (s->state == STATE_YRECEIVE && !yreceive_input(&s->yr, rx[j])) {
+                session_yreceive_done(s);
+            }
+            if (s->state == STATE_TEXT && s->text_prompt[0] && s->text_wait != TEXT_SENDING) {
+                session_text_input(s, rx[j]);
+            }
+        }
+    }
+}
+
+void session_timer(session *s)
+{
+    s->timer_at = 0;
+    if (s->state == STATE_YMODEM) {
+        ymodem_timeout(&s->ym);
+    } else if (s->state == STATE_ZMODEM) {
+        zmodem_timeout(&s->zm);
+    } else if (s->state == STATE_YRECEIVE) {
+        yreceive_timeout(&s->yr);
+    } else if (s->state == STATE_TEXT) {
+        session_text_timer(s);
+    } else if (s->state == STATE_PATCHING && s->patch_at && stats_now() >= s->patch_at) {
+        session_patch_timer(s);
+    }
+}
+
+// keep the loop timer on the transfer's deadline
+static void session_deadline(session *s)
+{
+    double deadline = 0;
+    if (s->state == STATE_YMODEM) {
+        deadline = s->ym.deadline;
+    } else if (s->state == STATE_ZMODEM) {
+        deadline = s->zm.deadline;
+    } else if (s->state == STATE_YRECEIVE) {
+        deadline = s->yr.deadline;
+    } else if (s->state == STATE_TEXT) {
+        deadline = s->text_at;
+    } else if (s->state == STATE_PATCHING) {
+        deadline = s->patch_at;
+    }
+    if (deadline == s->timer_at) return;
+
+    long usec = 0;
+    if (deadline) {
+        // round up, so the timer never fires just short of the deadline
+        usec = (long)((deadline - stats_now()) * 1e6) + 1;
+        if (usec < 1) usec = 1;
+    }
+    evl_set_timer(s->loop, s->timer, usec);
+    s->timer_at = deadline;
+}
+
+void session_output(session *s)
+{
+    int want_write = 0;
+    switch (s->state) {
+        case STATE_CONSOLEIO:
+            want_write = console_flush(s);
+            if (!want_write && s->pending_baud) {
+                // the target switches once its command is out, so follow it only after the drain
+                tcdrain(s->fd);
+                if (set_baud(s->fd, s->pending_baud) == 0) {
+                    s->baud = s->pending_baud;
+                    printf("\nline now at %ld baud\n", s->baud);
+                }
+                s->pending_baud = 0;
+            }
+            break;
+        case STATE_YMODEM:
+            s->ym.capture = s->capture;
+            want_write = ymodem_output(&s->ym, s->fd);
+            if (s->ym.state == YMODEM_DONE) {
+                session_ymodem_done(s);
+                want_write = session_console_queued(s) > 0;
+            }
+            break;
+        case STATE_ZMODEM:
+            s->zm.capture = s->capture;
+            want_write = zmodem_output(&s->zm, s->fd);
+            if (s->zm.state == ZMODEM_DONE && !want_write) {
+                session_zmodem_done(s);
+                want_write = session_console_queued(s) > 0;
+            }
+            break;
+        case STATE_YRECEIVE:
+            s->yr.capture = s->capture;
+            want_write = yreceive_output(&s->yr, s->fd);
+            if (s->yr.state == YRECEIVE_DONE && !want_write) {
+                session_yreceive_done(s);
+                want_write = session_console_queued(s) > 0;
+            }
+            break;
+        case STATE_TEXT:
+            want_write = session_text_output(s);
+            if (s->state == STATE_CONSOLEIO) want_write = console_flush(s);
+            break;
+        case STATE_PATCHING:
+            want_write = session_patch_output(s);
+            if (s->state == STATE_CONSOLEIO) {
+                if (!s->echo) printf("%s: patch upload done\n", s->device);
+                want_write = session_console_queued(s) > 0;
+            }
+            break;
+    }
+
+    if (want_write || s->write_state) {
+        evl_set_write(s->loop, s->fd, want_write);
+        s->write_state = want_write;
+    }
+    session_deadline(s);
+}
@@ -0,0 +1,130 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "evloop.h"
+#include "trs20.h"
+#include "capture.h"
+#include "image.h"
+#include "ymodem.h"
+#include "zmodem.h"
+#include "yreceive.h"
+
+#define STATE_CONSOLEIO         0               // just doing regular old console IO
+#define STATE_PATCHING          1               // faux-ymodem patch upload
+#define STATE_YMODEM            2               // ymodem transmit
+#define STATE_ZMODEM            3               // zmodem transmit
+#define STATE_YRECEIVE          4               // ymodem receive
+#define STATE_TEXT              5               // streaming a text file to the console
+
+#define CONSOLE_RING            65536           // console output bytes queued for the device, a power of two
+#define TEXT_SENDING            0               // queueing text as the ring has room
+#define TEXT_DRAIN              1               // a paced line is queued, waiting for it to go to the tty
+#define TEXT_PROMPT             2               // waiting for the device's prompt after the line
+#define TEXT_PAUSE              3               // waiting out the delay after the line
+#define TEXT_PROMPT_TIMEOUT     10.0            // seconds to wait for the prompt after a line
+
+#define PATCH_Y                 0               // sent 'y', waiting a bit
+#define PATCH_PREAMBLE          1               // sending SOH/STX, 00, FF
+#define PATCH_XMIT              2               // transmitting file data
+#define PATCH_WAIT              3               // wait for a byte back
+#define PATCH_ABORT             4               // aborting transfer
+#define PATCH_PROBE             5               // calibrating: does the receiver a 'y' starts take a block at line rate
+
+#define PATCH_GAP_DEFAULT       5000            // microseconds between patch bytes, unless told otherwise
+#define PATCH_GAP_MIN           500             // calibration's first try
+#define PATCH_GAP_MAX           50000           // calibration's last try
+#define PATCH_HEADER_GAP        25000           // microseconds after each header byte, which the bootrom checks slowly
+#define PATCH_START_DELAY       50000           // microseconds for the bootrom receiver to start after 'y'
+#define PATCH_NAK_TIMEOUT       2000000         // wait for the NAK that ends the faux block 0
+#define PATCH_PROBE_TIMEOUT     3000000         // wait for a receiver to poll after a 'y', and to answer the probe block
+
+// everything about one serial device: the console, and the patch, YModem or ZModem transfer running on it
+typedef struct session
+{
+    const char *device;
+    int fd;
+    long baud;
+    evloop *loop;
+    int timer;                  // loop timer id for this session's deadlines
+    double timer_at;            // deadline the timer is armed for, 0 if idle
+    int state;                  // STATE_XXX constant
+    int echo;                   // render device output and transfer progress on the terminal
+    int write_state;            // write readiness is armed
+    int failures;               // transfers that didn't complete
+    capture *capture;           // RX/TX log, or NULL if not capturing
+
+    // keystrokes and streamed text on their way to the device
+    uint8_t console_ring[CONSOLE_RING];
+    size_t console_head;        // written to the tty up to here
+    size_t console_tail;        // queued up to here
+
+    // streaming a text file: a line at a time when paced, otherwise as fast as the ring drains
+    image text;
+    size_t text_offset;         // file bytes queued so far
+    long text_delay;            // microseconds after each line is on the wire, 0 for none
+    char text_prompt[64];       // wait for the device to print this after each line, "" for no wait
+    size_t text_match;          // prompt bytes matched so far
+    int text_wait;              // TEXT_XXX constant
+    double text_at;             // when the delay is over, or the prompt wait runs out; 0 if neither
+    size_t text_line_len;       // bytes in the paced line, for its time on the wire
+    unsigned text_lines;
+    double text_started;
+
+    // device output kept off the terminal while the COMM> prompt is open
+    int hold;
+    uint8_t held[65536];
+    size_t held_len;
+    size_t held_dropped;
+
+    // host rate to switch to once the target has been sent its own baud command
+    long pending_baud;
+
+    // low latency mode: the driver tuned down, and YModem packets drained before their ACK is timed
+    int low_latency;
+    latency_settings latency_saved;
+    double turnaround;          // mean receiver turnaround of the last YModem batch, 0 if none yet
+    double turnaround_before;   // the last one before low latency went on
+
+    // transmitting a patchfile
+    char patch_data[1024];
+    size_t patch_idx;
+    ssize_t patch_size;
+    int patch_state;
+    char patch_preamble[3];
+    int patch_preidx;
+    long patch_gap;             // microseconds between patch bytes
+    int patch_calibrate;        // slowing patch_gap down until the patch takes
+    double patch_at;            // when the wait before the next patch byte is over, 0 if not waiting
+
+    ymodem_state ym;
+    zmodem_state zm;
+    yreceive_state yr;
+    char segment_dir[64];       // holds the files for the address ranges of HEX, S-record or ELF images, "" if none
+} session;
+
+// open the device and watch it on the loop, with its own timer id; returns 0 if it wouldn't open, leaving a session
+// that session_close still takes
+int session_open(session *s, evloop *loop, const char *device, long baud, int timer);
+void session_close(session *s);
+// log the device's traffic to path and path.txt, stopping any capture already running; returns 1 if successful
+int session_capture(session *s, const char *path);
+void session_capture_stop(session *s);
+// run a COMM> command line, returns 1 if it was accepted
+int session_command(session *s, char *line);
+// queue a keystroke for the device, returns 0 if the console ring is full
+int session_key(session *s, char input);
+// bytes of console output still to go to the device
+size_t session_console_queued(const session *s);
+// keep device output and progress lines off the terminal, or show what was kept and carry on echoing
+void session_hold(session *s, int hold);
+// drain the device, echoing it and feeding the transfer state machines
+void session_read(session *s);
+// the session's timer fired
+void session_timer(session *s);
+// push out whatever is pending, arming write readiness only while the tty is full
+void session_output(session *s);
+
+#endif
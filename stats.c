@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define PROGRESS_INTERVAL       0.2             // seconds between progress line redraws
+
+double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int stats_expired(double deadline)
+{
+    return deadline != 0 && stats_now() >= deadline;
+}
+
+void stats_start(xfer_stats *stats, int state, uint64_t total)
+{
+    int progress = stats->progress;
+    memset(stats, 0, sizeof(xfer_stats));
+    stats->progress = progress;
+    stats->start = stats->state_since = stats_now();
+    stats->state = state;
+    stats->total = total;
+}
+
+void stats_state(xfer_stats *stats, int state)
+{
+    if (state == stats->state) return;
+
+    double now = stats_now();
+    if (stats->state >= 0 && stats->state < STATS_MAX_STATES) {
+        stats->state_time[stats->state] += now - stats->state_since;
+    }
+    stats->state = state;
+    stats->state_since = now;
+}
+
+void stats_sent(xfer_stats *stats)
+{
+    stats->sent_at = stats_now();
+}
+
+void stats_acked(xfer_stats *stats, uint64_t payload)
+{
+    stats->payload += payload;
+    if (stats->sent_at == 0) return;
+
+    double latency = stats_now() - stats->sent_at;
+    stats->sent_at = 0;
+
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && latency * 1e6 >= (double)(STATS_BUCKET_BASE << bucket)) bucket++;
+    stats->latency[bucket]++;
+    if (stats->latency_count == 0 || latency < stats->latency_min) stats->latency_min = latency;
+    if (latency > stats->latency_max) stats->latency_max = latency;
+    stats->latency_sum += latency;
+    stats->latency_count++;
+}
+
+void stats_progress(xfer_stats *stats)
+{
+    double now = stats_now();
+    if (!stats->progress || now - stats->progress_at < PROGRESS_INTERVAL) return;
+    stats->progress_at = now;
+
+    double elapsed = now - stats->start;
+    printf("\r%5.1f%% %llu/%llu bytes  %.1f KB/s  naks %u  retransmits %u  timeouts %u ",
+           stats->total ? 100.0 * stats->payload / stats->total : 100.0,
+           (unsigned long long)stats->payload, (unsigned long long)stats->total,
+           elapsed > 0 ? stats->payload / elapsed / 1024 : 0.0, stats->naks, stats->retransmits,
+           stats->timeouts);
+    fflush(stdout);
+}
+
+void stats_finish(xfer_stats *stats, int state)
+{
+    stats_state(stats, state);
+    stats->end = stats_now();
+    if (stats->progress_at) printf("\n");
+}
+
+void stats_report(const xfer_stats *stats, FILE *out)
+{
+    double elapsed = stats->end - stats->start;
+    // the data goes out when sending and comes in when receiving, whichever way is the busy one
+    uint64_t wire = stats->wire_tx > stats->wire_rx ? stats->wire_tx : stats->wire_rx;
+    fprintf(out, "%llu bytes in %u blocks, %.2fs, %.1f KB/s payload, %.1f KB/s on the wire\n",
+            (unsigned long long)stats->payload, stats->blocks, elapsed,
+            elapsed > 0 ? stats->payload / elapsed / 1024 : 0.0,
+            elapsed > 0 ? wire / elapsed / 1024 : 0.0);
+    fprintf(out, "naks %u, retransmits %u, timeouts %u, cans %u", stats->naks, stats->retransmits,
+            stats->timeouts, stats->cans);
+    if (stats->latency_count) {
+        fprintf(out, ", ack latency min %.1fms avg %.1fms max %.1fms", stats->latency_min * 1e3,
+                stats->latency_sum / stats->latency_count * 1e3, stats->latency_max * 1e3);
+    }
+    fprintf(out, "\n");
+}
+
+int stats_json(const xfer_stats *stats, const char *path, const char *protocol,
+               const char *const *state_names, int state_count)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+
+    double elapsed = stats->end - stats->start;
+    fprintf(out, "{\n  \"protocol\": \"%s\",\n  \"seconds\": %.6f,\n", protocol, elapsed);
+    fprintf(out, "  \"payload_bytes\": %llu,\n  \"expected_bytes\": %llu,\n",
+            (unsigned long long)stats->payload, (unsigned long long)stats->total);
+    fprintf(out, "  \"wire_tx_bytes\": %llu,\n  \"wire_rx_bytes\": %llu,\n",
+            (unsigned long long)stats->wire_tx, (unsigned long long)stats->wire_rx);
+    fprintf(out, "  \"payload_bytes_per_second\": %.1f,\n", elapsed > 0 ? stats->payload / elapsed : 0.0);
+    fprintf(out, "  \"blocks\": %u,\n  \"naks\": %u,\n  \"retransmits\": %u,\n  \"timeouts\": %u,\n  \"cans\": %u,\n",
+            stats->blocks, stats->naks, stats->retransmits, stats->timeouts, stats->cans);
+
+    fprintf(out, "  \"state_seconds\": {");
+    for (int i = 0; i < state_count && i < STATS_MAX_STATES; i++) {
+        fprintf(out, "%s\n    \"%s\": %.6f", i ? "," : "", state_names[i], stats->state_time[i]);
+    }
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"ack_latency\": {\n    \"count\": %u,\n", stats->latency_count);
+    if (stats->latency_count) {
+        fprintf(out, "    \"min_us\": %.0f,\n    \"mean_us\": %.0f,\n    \"max_us\": %.0f,\n",
+                stats->latency_min * 1e6, stats->latency_sum / stats->latency_count * 1e6, stats->latency_max * 1e6);
+    }
+    fprintf(out, "    \"histogram\": [");
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (i < STATS_BUCKETS - 1) {
+            fprintf(out, "%s\n      { \"lt_us\": %d, \"count\": %u }", i ? "," : "", STATS_BUCKET_BASE << i, stats->latency[i]);
+        } else {
+            fprintf(out, ",\n      { \"lt_us\": null, \"count\": %u }", stats->latency[i]);
+        }
+    }
+    fprintf(out, "\n    ]\n  }\n}\n");
+
+    int failed = ferror(out);
+    if (fclose(out) != 0 || failed) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_MAX_STATES        16              // protocol states that can be timed
+#define STATS_BUCKETS           16              // latency histogram buckets
+#define STATS_BUCKET_BASE       128             // upper bound of the first bucket, in microseconds
+
+typedef struct xfer_stats
+{
+    double start;               // monotonic seconds at the start of the transfer, 0 if not running
+    double end;                 // set by stats_finish
+    int state;                  // protocol state being timed
+    double state_since;         // when that state was entered
+    double state_time[STATS_MAX_STATES];
+    uint64_t total;             // payload bytes expected, for the progress line
+    uint64_t payload;           // payload bytes acknowledged
+    uint64_t wire_tx;           // bytes written to the line, framing and retransmits included
+    uint64_t wire_rx;           // bytes read from the line
+    unsigned blocks;            // data blocks delivered
+    unsigned naks;              // NAKs received
+    unsigned retransmits;       // packets sent again
+    unsigned timeouts;          // waits on the receiver that ran out
+    unsigned cans;              // CAN bytes received
+    double sent_at;             // when the packet in flight was handed to the tty, 0 if none
+    unsigned latency[STATS_BUCKETS];            // block-to-ACK latency, bucket i holds < BASE << i us
+    unsigned latency_count;
+    double latency_sum;
+    double latency_min;
+    double latency_max;
+    double progress_at;         // when the progress line was last drawn
+    int progress;               // draw the live progress line
+} xfer_stats;
+
+double stats_now(void);
+// 1 once deadline has passed; 0 if it's unset, or the timer that woke us was armed for an earlier one
+int stats_expired(double deadline);
+void stats_start(xfer_stats *stats, int state, uint64_t total);
+// note the protocol state, charging the time since the last change to the old one
+void stats_state(xfer_stats *stats, int state);
+// the packet in flight has been handed to the tty
+void stats_sent(xfer_stats *stats);
+// the packet in flight was acknowledged, carrying payload bytes of file data
+void stats_acked(xfer_stats *stats, uint64_t payload);
+void stats_progress(xfer_stats *stats);
+void stats_finish(xfer_stats *stats, int state);
+void stats_report(const xfer_stats *stats, FILE *out);
+// write the summary as JSON, naming the states with state_names; returns 0 on success
+int stats_json(const xfer_stats *stats, const char *path, const char *protocol,
+               const char *const *state_names, int state_count);
+
+#endif
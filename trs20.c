@@ -1,31 +1,123 @@
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#ifdef __APPLE__
+#include <IOKit/serial/ioss.h>
+#endif
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
-int open_device(const char *device, speed_t baud)
+#include "trs20.h"
+
+static const struct { long baud; speed_t speed; } baud_rates[] = {
+    { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 },
+    { 230400, B230400 },
+#ifdef B460800
+    { 460800, B460800 },
+#endif
+#ifdef B921600
+    { 921600, B921600 },
+#endif
+};
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__i386__) || defined(__arm__) || defined(__aarch64__))
+/*
+ * termios2 lets the kernel take any rate the UART can divide down to. The
+ * kernel's struct clashes with glibc's <termios.h>, so it's declared here;
+ * this is the asm-generic layout, which only x86 and ARM are known to share.
+ * Elsewhere (PowerPC, MIPS, SPARC, Alpha) only the standard rates are taken.
+ */
+struct termios2
+{
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t c_line;
+    cc_t c_cc[19];
+    speed_t c_ispeed;
+    speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER                  0010000
+#endif
+
+static int set_custom_baud(int fd, long baud)
+{
+    struct termios2 config;
+    if (ioctl(fd, TCGETS2, &config) < 0) return -1;
+    config.c_cflag &= ~CBAUD;
+    config.c_cflag |= BOTHER;
+    config.c_ispeed = baud;
+    config.c_ospeed = baud;
+    return ioctl(fd, TCSETS2, &config);
+}
+#elif defined(__APPLE__)
+static int set_custom_baud(int fd, long baud)
+{
+    speed_t speed = baud;
+    return ioctl(fd, IOSSIOSPEED, &speed);
+}
+#else
+static int set_custom_baud(int fd, long baud)
+{
+    errno = EINVAL;
+    return -1;
+}
+#endif
+
+int set_baud(int fd, long baud)
+{
+    for (size_t i = 0; i < sizeof(baud_rates) / sizeof(baud_rates[0]); i++) {
+        if (baud_rates[i].baud == baud) {
+            struct termios config;
+            if (tcgetattr(fd, &config) < 0 || cfsetspeed(&config, baud_rates[i].speed) < 0
+                    || tcsetattr(fd, TCSADRAIN, &config) < 0) {
+                perror("can't set baud rate");
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    if (set_custom_baud(fd, baud) < 0) {
+        perror("can't set non-standard baud rate");
+        return -1;
+    }
+    return 0;
+}
+
+int open_device(const char *device, long baud)
 {
     int fd = open(device, O_RDWR | O_NONBLOCK | O_NOCTTY);
     if (fd == -1)
     {
         perror("can't open device");
-        exit(errno);
+        return -1;
     }
 
     struct termios config;
     if (tcgetattr(fd, &config) < 0)
     {
         perror("can't get serial attributes");
-        exit(errno);
+        close(fd);
+        return -1;
     }
 
     /* setup for non-canonical mode */
     cfmakeraw(&config);
 
-    cfsetspeed(&config, baud);
-
     config.c_cflag |= (CRTSCTS | CREAD);
     config.c_cflag &= ~CSTOPB;
     config.c_cflag &= ~CLOCAL;
@@ -36,12 +128,111 @@ int open_device(const char *device, speed_t baud)
     if (tcsetattr(fd, TCSAFLUSH, &config) < 0)
     {
         perror("can't set serial attributes");
-        exit(errno);
+        close(fd);
+        return -1;
+    }
+
+    if (set_baud(fd, baud) < 0)
+    {
+        close(fd);
+        return -1;
     }
 
     return fd;
 }
 
+#if defined(__linux__)
+/*
+ * The driver's knobs for latency: ASYNC_LOW_LATENCY has the tty layer push
+ * received bytes to the reader at once rather than from a work queue, and
+ * ftdi_sio also drops its latency timer to 1ms for it. The 8250 driver's
+ * receive FIFO trigger and a USB adapter's latency timer are in sysfs, under
+ * the tty's name.
+ */
+static void tty_sysfs(const char *device, const char *attribute, char *path, size_t size)
+{
+    char real[PATH_MAX];
+    if (!realpath(device, real)) snprintf(real, sizeof(real), "%s", device);
+    snprintf(path, size, "/sys/class/tty/%s/%s", basename(real), attribute);
+}
+
+// read a sysfs attribute into value and write replacement over it; returns 0 if there is no such attribute
+static int sysfs_swap(const char *path, char *value, size_t size, const char *replacement)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    if (!fgets(value, size, f)) value[0] = 0;
+    fclose(f);
+    value[strcspn(value, "\n")] = 0;
+
+    f = fopen(path, "w");
+    if (!f || fprintf(f, "%s\n", replacement) < 0 || fclose(f) != 0) {
+        perror(path);
+        if (f) fclose(f);
+        value[0] = 0;
+        return 0;
+    }
+    return 1;
+}
+
+int low_latency_on(int fd, const char *device, latency_settings *saved)
+{
+    int took = 0;
+    char path[PATH_MAX + 64];
+    struct serial_struct serial;
+
+    saved->serial_flags = -1;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        saved->serial_flags = serial.flags;
+        serial.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(fd, TIOCSSERIAL, &serial) == 0) took |= LATENCY_ASYNC;
+    }
+
+    // the 8250 rounds the trigger up to a level the UART has
+    saved->rx_trig[0] = 0;
+    tty_sysfs(device, "rx_trig_bytes", path, sizeof(path));
+    if (sysfs_swap(path, saved->rx_trig, sizeof(saved->rx_trig), "1")) took |= LATENCY_FIFO;
+
+    saved->latency_timer[0] = 0;
+    tty_sysfs(device, "device/latency_timer", path, sizeof(path));
+    if (sysfs_swap(path, saved->latency_timer, sizeof(saved->latency_timer), "1")) took |= LATENCY_TIMER;
+
+    return took;
+}
+
+void low_latency_off(int fd, const char *device, const latency_settings *saved)
+{
+    char path[PATH_MAX + 64];
+    char ignored[16];
+    struct serial_struct serial;
+
+    if (saved->serial_flags >= 0 && ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags = (serial.flags & ~ASYNC_LOW_LATENCY) | (saved->serial_flags & ASYNC_LOW_LATENCY);
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+    if (saved->rx_trig[0]) {
+        tty_sysfs(device, "rx_trig_bytes", path, sizeof(path));
+        sysfs_swap(path, ignored, sizeof(ignored), saved->rx_trig);
+    }
+    if (saved->latency_timer[0]) {
+        tty_sysfs(device, "device/latency_timer", path, sizeof(path));
+        sysfs_swap(path, ignored, sizeof(ignored), saved->latency_timer);
+    }
+}
+#else
+int low_latency_on(int fd, const char *device, latency_settings *saved)
+{
+    saved->serial_flags = -1;
+    saved->rx_trig[0] = 0;
+    saved->latency_timer[0] = 0;
+    return 0;
+}
+
+void low_latency_off(int fd, const char *device, const latency_settings *saved)
+{
+}
+#endif
+
 static const uint16_t ym_crc_tab[32] = {
     0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
     0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
@@ -55,11 +246,214 @@ uint16_t crc16(uint16_t crc, uint8_t byte)
     return (crc << 8) ^ ym_crc_tab[pos & 0xf] ^ ym_crc_tab[(pos >> 4) + 16];
 }
 
-uint16_t crc(const uint8_t *data, size_t size)
+/*
+ * The CRC-CCITT (XModem) engines below all compute the same value as running
+ * crc16() over the data; crc() picks the fastest one the CPU supports.
+ */
+
+static uint16_t crc_nibble(uint16_t crc, const uint8_t *data, size_t size)
 {
-    uint16_t crc = 0;
     for (size_t i = 0; i < size; i++) {
         crc = crc16(crc, data[i]);
     }
     return crc;
 }
+
+// crc_slice[k][b] is the CRC of byte b followed by k zero bytes
+static uint16_t crc_slice[8][256];
+
+static void crc_tables_init(void)
+{
+    for (int b = 0; b < 256; b++) {
+        crc_slice[0][b] = crc16(0, b);
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint16_t prev = crc_slice[k - 1][b];
+            crc_slice[k][b] = (prev << 8) ^ crc_slice[0][prev >> 8];
+        }
+    }
+}
+
+static uint16_t crc_table(uint16_t crc, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc << 8) ^ crc_slice[0][(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+static uint16_t crc_slice8(uint16_t crc, const uint8_t *data, size_t size)
+{
+    while (size >= 8) {
+        crc = crc_slice[7][data[0] ^ (crc >> 8)] ^ crc_slice[6][data[1] ^ (crc & 0xff)]
+            ^ crc_slice[5][data[2]] ^ crc_slice[4][data[3]]
+            ^ crc_slice[3][data[4]] ^ crc_slice[2][data[5]]
+            ^ crc_slice[1][data[6]] ^ crc_slice[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    return crc_table(crc, data, size);
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CRC_CLMUL
+#include <immintrin.h>
+
+// x^n mod P, for the folding constants
+static uint64_t xpow_mod(int n)
+{
+    uint32_t r = 1;
+    while (n-- > 0) {
+        r <<= 1;
+        if (r & 0x10000) r ^= 0x11021;
+    }
+    return r;
+}
+
+static uint64_t fold_128_hi, fold_128_lo;      // x^192, x^128 mod P
+static uint64_t fold_512_hi, fold_512_lo;      // x^576, x^512 mod P
+
+/*
+ * Carry-less multiply folding: the message is taken as big-endian 128-bit
+ * lanes, and a lane H:L followed by n more bits is congruent mod P to
+ * H * (x^(n+64) mod P) ^ L * (x^n mod P). Four lanes are folded in parallel,
+ * collapsed to one, and the table engine reduces the last 16 bytes.
+ */
+__attribute__((target("pclmul,ssse3")))
+static __m128i crc_fold(__m128i acc, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(acc, k, 0x11), _mm_clmulepi64_si128(acc, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint16_t crc_clmul(uint16_t crc, const uint8_t *data, size_t size)
+{
+    if (size < 64) return crc_slice8(crc, data, size);
+
+    const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k128 = _mm_set_epi64x(fold_128_hi, fold_128_lo);
+    const __m128i k512 = _mm_set_epi64x(fold_512_hi, fold_512_lo);
+
+    // the incoming CRC is congruent to the message so far times x^16, which lines it up with the first lane's top bits
+    __m128i acc[4];
+    for (int i = 0; i < 4; i++) {
+        acc[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), swap);
+    }
+    acc[0] = _mm_xor_si128(acc[0], _mm_set_epi64x((uint64_t)crc << 48, 0));
+    data += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        for (int i = 0; i < 4; i++) {
+            __m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), swap);
+            acc[i] = _mm_xor_si128(crc_fold(acc[i], k512), next);
+        }
+        data += 64;
+        size -= 64;
+    }
+
+    __m128i sum = acc[0];
+    for (int i = 1; i < 4; i++) {
+        sum = _mm_xor_si128(crc_fold(sum, k128), acc[i]);
+    }
+    while (size >= 16) {
+        __m128i next = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), swap);
+        sum = _mm_xor_si128(crc_fold(sum, k128), next);
+        data += 16;
+        size -= 16;
+    }
+
+    uint8_t lane[16];
+    _mm_storeu_si128((__m128i *)lane, _mm_shuffle_epi8(sum, swap));
+    return crc_slice8(crc_slice8(0, lane, 16), data, size);
+}
+#endif
+
+static crc_engine engines[4];
+static int engine_count = 0;
+static crc_fn fastest;
+// the tables and the engine list are built once, whichever thread asks first
+static pthread_once_t engines_once = PTHREAD_ONCE_INIT;
+
+static void crc_engines_init(void)
+{
+    crc_tables_init();
+    engines[engine_count++] = (crc_engine){ "nibble", crc_nibble };
+    engines[engine_count++] = (crc_engine){ "table", crc_table };
+    engines[engine_count++] = (crc_engine){ "slice8", crc_slice8 };
+#ifdef CRC_CLMUL
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+        fold_128_hi = xpow_mod(192);
+        fold_128_lo = xpow_mod(128);
+        fold_512_hi = xpow_mod(576);
+        fold_512_lo = xpow_mod(512);
+        engines[engine_count++] = (crc_engine){ "clmul", crc_clmul };
+    }
+#endif
+    fastest = engines[engine_count - 1].update;
+}
+
+int crc_engines(const crc_engine **list)
+{
+    pthread_once(&engines_once, crc_engines_init);
+    *list = engines;
+    return engine_count;
+}
+
+uint16_t crc_update(uint16_t crc, const uint8_t *data, size_t size)
+{
+    pthread_once(&engines_once, crc_engines_init);
+    return fastest(crc, data, size);
+}
+
+uint16_t crc(const uint8_t *data, size_t size)
+{
+    return crc_update(0, data, size);
+}
+
+/*
+ * CRC-32 (IEEE 802.3, reflected), as ZModem uses for its 32-bit frames. It
+ * chains the way zlib's does: crc32(crc32(0, a), b) is the CRC of a then b.
+ */
+
+// crc32_slice[k][b] is the CRC register after byte b and k zero bytes
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_tables_init(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t r = b;
+        for (int i = 0; i < 8; i++) {
+            r = r & 1 ? (r >> 1) ^ 0xedb88320 : r >> 1;
+        }
+        crc32_slice[0][b] = r;
+    }
+    for (int k = 1; k < 8; k++) {
+        for (int b = 0; b < 256; b++) {
+            uint32_t prev = crc32_slice[k - 1][b];
+            crc32_slice[k][b] = (prev >> 8) ^ crc32_slice[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    pthread_once(&crc32_once, crc32_tables_init);
+
+    uint32_t r = ~crc;
+    while (size >= 8) {
+        uint32_t lo = r ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+        r = crc32_slice[7][lo & 0xff] ^ crc32_slice[6][(lo >> 8) & 0xff]
+          ^ crc32_slice[5][(lo >> 16) & 0xff] ^ crc32_slice[4][lo >> 24]
+          ^ crc32_slice[3][data[4]] ^ crc32_slice[2][data[5]]
+          ^ crc32_slice[1][data[6]] ^ crc32_slice[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        r = (r >> 8) ^ crc32_slice[0][(r ^ *data++) & 0xff];
+    }
+    return ~r;
+}
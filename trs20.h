@@ -1,10 +1,44 @@
 #ifndef TRS20_H
 #define TRS20_H
 
+#include <stdint.h>
+#include <stddef.h>
 #include <termios.h>
 
-int open_device(const char *device, speed_t baud);
+#define LATENCY_ASYNC           1               // the driver took ASYNC_LOW_LATENCY
+#define LATENCY_FIFO            2               // the UART's receive FIFO triggers at its lowest level
+#define LATENCY_TIMER           4               // a USB adapter's latency timer is at 1ms
+
+// what low_latency_on changed, so low_latency_off can put it back
+typedef struct latency_settings
+{
+    int serial_flags;           // ASYNC_XXX flags before, -1 if the driver has no serial_struct
+    char rx_trig[16];           // sysfs rx_trig_bytes before, "" if there is none
+    char latency_timer[16];     // sysfs latency_timer before, "" if there is none
+} latency_settings;
+
+// open the tty raw at baud; returns the fd, or -1 with the reason printed
+int open_device(const char *device, long baud);
+// tune the driver for the least receive latency it offers; returns the LATENCY_XXX settings it took
+int low_latency_on(int fd, const char *device, latency_settings *saved);
+void low_latency_off(int fd, const char *device, const latency_settings *saved);
+// set the line rate, standard or not; returns -1 if the driver won't take it
+int set_baud(int fd, long baud);
 uint16_t crc16(uint16_t crc, uint8_t byte);
 uint16_t crc(const uint8_t *data, size_t size);
+uint16_t crc_update(uint16_t crc, const uint8_t *data, size_t size);
+// CRC-32 of data continuing from crc, which is 0 to start
+uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size);
+
+typedef uint16_t (*crc_fn)(uint16_t crc, const uint8_t *data, size_t size);
+
+typedef struct crc_engine
+{
+    const char *name;
+    crc_fn update;
+} crc_engine;
+
+// the CRC engines this CPU can run, slowest first; crc() uses the last one
+int crc_engines(const crc_engine **list);
 
 #endif
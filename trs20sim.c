@@ -0,0 +1,1374 @@
+#define _GNU_SOURCE                             // posix_openpt and friends on glibc
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "trs20.h"
+
+/*
+ * trs20sim stands in for a TRS-20 on the far end of a pseudo-terminal, so the
+ * patch and YModem paths of scomm can be exercised and timed without a board.
+ *
+ * The target starts at a monitor prompt. A 'y' starts its YModem receiver:
+ * in buggy mode that's the bootrom receiver, which polls with 'C' like any
+ * other, takes scomm's faux block 0 patch one slow byte at a time, installs
+ * it when the upload is cancelled, and NAKs a block whose header it loses;
+ * in patched mode it's a proper YModem/YModem-1K/YModem-G batch receiver.
+ * With -z, an "rz" command line starts a ZModem receiver instead, which can
+ * resume a partial file and can be told to break off part way through.
+ * With -S, an "sb" command line sends that file with YModem-1K, for scomm's
+ * receive command to take.
+ *
+ * The line can be slowed to a baud rate, delayed, and made to corrupt bytes
+ * or lose ACKs. Given a command after --, trs20sim runs it with {} replaced
+ * by the pty path, and reports how long each transfer took once it exits.
+ */
+
+#define TARGET_MONITOR          0               // console, 'y' starts a receiver
+#define TARGET_BUGGY            1               // bootrom receiver taking a patch
+#define TARGET_RECEIVE          2               // patched YModem receiver
+#define TARGET_ZMODEM           3               // ZModem receiver, started by rz
+#define TARGET_SEND             4               // YModem-1K sender, started by sb
+
+#define BUGGY_START             0               // receiver still starting, bytes are lost; then polling with 'C'
+#define BUGGY_HEADER            1               // waiting for SOH/STX, 00, FF
+#define BUGGY_DATA              2               // taking patch bytes
+#define BUGGY_NAKED             3               // NAKed the block, waiting for the CANs
+#define BUGGY_PURGE             4               // bad header, taking bytes until the line goes quiet to NAK
+
+#define SB_WAIT_C               0               // YModem sender: waiting for the receiver's first C
+#define SB_HEADER_ACK           1               // sent block 0, waiting for its ACK
+#define SB_WAIT_START           2               // waiting for the C that starts the data
+#define SB_DATA_ACK             3               // sent a data block, waiting for its ACK
+#define SB_EOT_ACK              4               // sent EOT
+#define SB_FINAL_C              5               // waiting for the C for the next block 0
+#define SB_END_ACK              6               // sent the empty block 0
+
+#define ZR_IDLE                 0               // ZModem receiver: looking for ZPAD
+#define ZR_PAD                  1               // seen ZPAD
+#define ZR_DLE                  2               // seen ZPAD ZDLE
+#define ZR_HEADER               3               // reading a header
+#define ZR_DATA                 4               // reading a subpacket
+#define ZR_CRC                  5               // reading the subpacket's CRC
+
+#define QUEUE_SIZE              65536           // bytes in flight each way on the line
+#define POLL_INTERVAL           20              // ms between checks on the child
+#define MAX_ERRORS              10              // receiver errors in a row before it cancels
+
+typedef struct line_byte
+{
+    uint8_t byte;
+    int64_t due;                // microsecond time the byte arrives at the far end
+} line_byte;
+
+typedef struct byte_queue
+{
+    line_byte q[QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+} byte_queue;
+
+// line and target settings from the command line
+static long baud = 0;                           // 0 for an unpaced line
+static long latency_us = 0;
+static double corrupt_rate = 0;
+static double drop_rate = 0;
+static long gap_us = 3000;                      // buggy receiver's time to take one patch byte
+static long start_us = 40000;                   // buggy receiver's start-up time after 'y'
+static long timeout_us = 3000000;               // patched receiver's wait before it NAKs
+static int patched = 0;
+static int autostart = 0;
+static int want_g = 0;
+static int zmodem = 0;                          // rz starts a ZModem receiver
+static long interrupt_at = 0;                   // ZModem receiver breaks off after this many file bytes, 0 never
+static const char *outdir = NULL;
+static const char *send_path = NULL;            // file an sb command line sends to scomm
+static const char *expect_patch = NULL;
+static int verbose = 0;
+
+static int master = -1;
+static byte_queue to_host, to_target;
+static int64_t tx_free_at = 0;
+
+// host to target: a thread takes bytes off the pty as scomm writes them, so each is timed by when it went
+// on the line, not by when the loop next wakes; to_target and rx_free_at are shared with it under rx_lock
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t rx_free_at = 0;
+static int wake_pipe[2];                        // the reader's nudge to the loop that bytes are queued
+static atomic_int rx_stop;                      // the reader exits
+
+static int target = TARGET_MONITOR;
+
+// buggy bootrom receiver
+static int buggy_state;
+static int64_t buggy_ready_at;
+static int buggy_holding;                       // the UART has a byte the bootrom hasn't picked up yet
+static uint8_t buggy_held;
+static int buggy_hdr_idx;
+static uint8_t buggy_data[2048];
+static size_t buggy_len;
+static unsigned buggy_overruns;
+static int64_t buggy_started;
+
+// patched receiver
+static uint8_t packet[3 + 1024 + 2];
+static size_t packet_len;
+static size_t packet_need;
+static int expect_block0;
+static uint8_t expect_seq;
+static int streaming;
+static int64_t rx_deadline;
+static int errors;
+static int cans;
+static char file_name[256];
+static long file_size;
+static uint8_t *file_data;
+static size_t file_len;
+static size_t file_cap;
+static int64_t batch_started;
+static long batch_bytes;
+static int batch_files;
+static unsigned naks_sent, acks_dropped, duplicates;
+static char monitor_line[16];
+static size_t monitor_len;
+
+// ZModem receiver
+static int zr_state;
+static int zr_kind;
+static uint8_t zr_header[16];
+static int zr_len, zr_need;
+static int zr_escape;
+static int zr_frame;                            // header the subpackets belong to: ZFILE, ZDATA, or 0 to skip them
+static int zr_crc32;                            // the frame's subpackets carry CRC-32
+static uint8_t zr_sub[1024 + 8];
+static size_t zr_sublen;
+static uint8_t zr_end;
+static uint8_t zr_crc[4];
+static int zr_crclen;
+static long zr_resumed;                         // bytes of the file that were already here
+
+// YModem sender
+static int sb_state;
+static uint8_t sb_block[3 + 1024 + 2];
+static size_t sb_len;
+static size_t sb_count;                         // file bytes in the block
+static uint8_t sb_seq;
+static uint8_t *send_data;
+static size_t send_len;
+static size_t send_offset;                      // file bytes acknowledged
+
+// results
+static unsigned corrupted;
+static int transfers_ok, transfers_failed;
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double chance(void)
+{
+    return random() / ((double)RAND_MAX + 1);
+}
+
+static int queue_empty(const byte_queue *q)
+{
+    return q->head == q->tail;
+}
+
+static int queue_push(byte_queue *q, uint8_t byte, int64_t due)
+{
+    size_t next = (q->tail + 1) % QUEUE_SIZE;
+    if (next == q->head) return 0;
+    q->q[q->tail].byte = byte;
+    q->q[q->tail].due = due;
+    q->tail = next;
+    return 1;
+}
+
+// the target sends bytes at the line rate, each arriving latency later
+static void target_send(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    int64_t now = now_us();
+    for (size_t i = 0; i < size; i++) {
+        int64_t start = tx_free_at > now ? tx_free_at : now;
+        tx_free_at = start + (baud ? 10000000 / baud : 0);
+        queue_push(&to_host, p[i], tx_free_at + latency_us);
+    }
+}
+
+static void target_puts(const char *text)
+{
+    target_send(text, strlen(text));
+}
+
+static void target_byte(uint8_t byte)
+{
+    target_send(&byte, 1);
+}
+
+static void ack(void)
+{
+    if (drop_rate > 0 && chance() < drop_rate) {
+        acks_dropped++;
+        return;
+    }
+    target_byte(6);
+}
+
+static void nak(void)
+{
+    naks_sent++;
+    target_byte(0x15);
+}
+
+static void report(const char *what, long bytes, int64_t elapsed)
+{
+    double seconds = elapsed / 1e6;
+    printf("sim: %s %ld bytes in %.3fs, %.1f KB/s, naks %u, dropped acks %u, duplicates %u, corrupted bytes %u\n",
+           what, bytes, seconds, seconds > 0 ? bytes / seconds / 1024 : 0.0,
+           naks_sent, acks_dropped, duplicates, corrupted);
+    fflush(stdout);
+}
+
+// poll for the next block 0, as a receiver does while nothing's coming
+static void receive_start(void)
+{
+    target = TARGET_RECEIVE;
+    batch_started = 0;
+    batch_bytes = 0;
+    batch_files = 0;
+    naks_sent = acks_dropped = duplicates = corrupted = 0;
+    expect_block0 = 1;
+    packet_len = 0;
+    packet_need = 0;
+    errors = 0;
+    cans = 0;
+    target_byte(want_g ? 'G' : 'C');
+    rx_deadline = now_us() + 1000000;
+}
+
+static void receive_abort(const char *why)
+{
+    printf("sim: transfer aborted: %s\n", why);
+    fflush(stdout);
+    target_puts("\x18\x18");
+    transfers_failed++;
+    free(file_data);
+    file_data = NULL;
+    target = TARGET_MONITOR;
+}
+
+static void file_finish(void)
+{
+    size_t size = file_size >= 0 && (size_t)file_size < file_len ? (size_t)file_size : file_len;
+    batch_bytes += size;
+    batch_files++;
+    if (verbose) printf("sim: received %s, %zu bytes\n", file_name, size);
+
+    if (outdir) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", outdir, file_name);
+        FILE *f = fopen(path, "w");
+        if (!f || fwrite(file_data, 1, size, f) != size) {
+            perror(path);
+        }
+        if (f) fclose(f);
+    }
+    free(file_data);
+    file_data = NULL;
+}
+
+static void receive_packet(void)
+{
+    size_t size = packet[0] == 2 ? 1024 : 128;
+    uint8_t *payload = packet + 3;
+    uint16_t sum = (payload[size] << 8) | payload[size + 1];
+
+    if ((uint8_t)~packet[1] != packet[2] || crc(payload, size) != sum) {
+        if (streaming) {
+            receive_abort("bad block during YModem-G");
+            return;
+        }
+        if (++errors >= MAX_ERRORS) {
+            receive_abort("too many errors");
+            return;
+        }
+        nak();
+        return;
+    }
+    errors = 0;
+
+    if (expect_block0) {
+        if (packet[1] != 0) {
+            nak();
+            return;
+        }
+        if (payload[0] == 0) {
+            // null header: the batch is over, and an empty one (scomm's calibration probe) isn't a transfer
+            target_byte(6);
+            if (batch_files > 0) {
+                report("ymodem", batch_bytes, now_us() - batch_started);
+                transfers_ok++;
+            }
+            target = TARGET_MONITOR;
+            if (autostart) receive_start();
+            return;
+        }
+        snprintf(file_name, sizeof(file_name), "%.255s", (char *)payload);
+        file_size = -1;
+        sscanf((char *)payload + strlen((char *)payload) + 1, "%ld", &file_size);
+        file_len = 0;
+        file_cap = file_size > 0 ? file_size + 1024 : 65536;
+        file_data = malloc(file_cap);
+        expect_block0 = 0;
+        expect_seq = 1;
+        streaming = want_g;
+        // YModem-G answers block 0 with its G alone, as the spec has it
+        if (!want_g) target_byte(6);
+        target_byte(want_g ? 'G' : 'C');
+        return;
+    }
+
+    if (packet[1] == (uint8_t)(expect_seq - 1)) {
+        // a retransmit after a lost ACK
+        duplicates++;
+        ack();
+        return;
+    }
+    if (packet[1] != expect_seq) {
+        receive_abort("sequence error");
+        return;
+    }
+
+    if (file_len + size > file_cap) {
+        file_cap = (file_len + size) * 2;
+        file_data = realloc(file_data, file_cap);
+    }
+    memcpy(file_data + file_len, payload, size);
+    file_len += size;
+    expect_seq++;
+    if (!streaming) ack();
+}
+
+static void receive_byte(uint8_t byte)
+{
+    rx_deadline = now_us() + timeout_us;
+
+    if (packet_need == 0) {
+        switch (byte) {
+            case 1:
+            case 2:
+                if (batch_started == 0) batch_started = now_us();
+                packet[0] = byte;
+                packet_len = 1;
+                packet_need = byte == 2 ? 3 + 1024 + 2 : 3 + 128 + 2;
+                cans = 0;
+                break;
+            case 4:
+                if (!expect_block0) {
+                    target_byte(6);
+                    file_finish();
+                    expect_block0 = 1;
+                    target_byte(want_g ? 'G' : 'C');
+                }
+                break;
+            case 0x18:
+                if (++cans >= 2) {
+                    // a sender that gives up before block 0, such as scomm checking for this receiver, hasn't failed a transfer
+                    printf("sim: sender cancelled\n");
+                    fflush(stdout);
+                    if (batch_started) transfers_failed++;
+                    free(file_data);
+                    file_data = NULL;
+                    target = TARGET_MONITOR;
+                }
+                break;
+        }
+        return;
+    }
+
+    packet[packet_len++] = byte;
+    if (packet_len == packet_need) {
+        packet_need = 0;
+        receive_packet();
+    }
+}
+
+static void receive_timeout(void)
+{
+    // a lost ACK or a stalled sender: ask again
+    packet_need = 0;
+    if (++errors >= MAX_ERRORS) {
+        receive_abort("timed out");
+        return;
+    }
+    if (expect_block0) {
+        target_byte(want_g ? 'G' : 'C');
+        rx_deadline = now_us() + 1000000;
+    } else {
+        nak();
+        rx_deadline = now_us() + timeout_us;
+    }
+}
+
+
+// ZModem frame types and subpacket ends the receiver deals with
+#define ZRQINIT                 0
+#define ZRINIT                  1
+#define ZACK                    3
+#define ZFILE                   4
+#define ZFIN                    8
+#define ZRPOS                   9
+#define ZDATA                   10
+#define ZEOF                    11
+#define ZCRCE                   'h'
+#define ZCRCG                   'i'
+#define ZCRCQ                   'j'
+#define ZCRCW                   'k'
+
+// the receiver answers in hex headers, as rz does
+static void zr_send(int type, uint32_t pos)
+{
+    static const char hex[] = "0123456789abcdef";
+    uint8_t header[7] = { type, pos, pos >> 8, pos >> 16, pos >> 24 };
+    uint16_t sum = crc_update(0, header, 5);
+    header[5] = sum >> 8;
+    header[6] = sum & 0xff;
+
+    uint8_t out[24];
+    size_t len = 0;
+    out[len++] = '*';
+    out[len++] = '*';
+    out[len++] = 0x18;
+    out[len++] = 'B';
+    for (int i = 0; i < 7; i++) {
+        out[len++] = hex[header[i] >> 4];
+        out[len++] = hex[header[i] & 0xf];
+    }
+    out[len++] = '\r';
+    out[len++] = 0x8a;
+    if (type != ZFIN && type != ZACK) out[len++] = 0x11;
+    target_send(out, len);
+}
+
+static void zr_rinit(void)
+{
+    // full duplex, can overlap I/O, CRC-32, no buffer limit
+    zr_send(ZRINIT, (uint32_t)(0x01 | 0x02 | 0x20) << 24);
+    rx_deadline = now_us() + 1000000;
+}
+
+// ask for the file from what's safely received; anything up to the next header is dropped
+static void zr_rpos(void)
+{
+    zr_frame = 0;
+    zr_send(ZRPOS, file_len);
+    rx_deadline = now_us() + timeout_us;
+}
+
+static void zmodem_start(void)
+{
+    target = TARGET_ZMODEM;
+    batch_started = 0;
+    batch_bytes = 0;
+    batch_files = 0;
+    naks_sent = acks_dropped = duplicates = corrupted = 0;
+    zr_state = ZR_IDLE;
+    zr_frame = 0;
+    errors = 0;
+    cans = 0;
+    zr_rinit();
+}
+
+static void zmodem_abort(const char *why)
+{
+    printf("sim: transfer aborted: %s\n", why);
+    fflush(stdout);
+    target_puts("\x18\x18\x18\x18\x18\x18\x18\x18\x08\x08\x08\x08\x08\x08\x08\x08");
+    transfers_failed++;
+    free(file_data);
+    file_data = NULL;
+    rx_deadline = 0;
+    target = TARGET_MONITOR;
+}
+
+// a ZFILE's information: take the name and length, and with ZCRESUM pick up a partial copy from outdir
+static void zr_file(int resume)
+{
+    snprintf(file_name, sizeof(file_name), "%.255s", (char *)zr_sub);
+    file_size = -1;
+    sscanf((char *)zr_sub + strlen((char *)zr_sub) + 1, "%ld", &file_size);
+    file_len = 0;
+    file_cap = file_size > 0 ? file_size + 1024 : 65536;
+    free(file_data);
+    file_data = malloc(file_cap);
+
+    if (resume && outdir) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", outdir, file_name);
+        FILE *f = fopen(path, "r");
+        if (f) {
+            file_len = fread(file_data, 1, file_cap, f);
+            fclose(f);
+            if (file_size >= 0 && file_len > (size_t)file_size) file_len = 0;
+        }
+    }
+    zr_resumed = file_len;
+    if (verbose && file_len) printf("sim: resuming %s at %zu\n", file_name, file_len);
+    if (batch_started == 0) batch_started = now_us();
+    zr_rpos();
+}
+
+static void zr_subpacket(void)
+{
+    uint32_t sum;
+    int good;
+    if (zr_crc32) {
+        sum = zr_crc[0] | zr_crc[1] << 8 | zr_crc[2] << 16 | (uint32_t)zr_crc[3] << 24;
+        good = crc32(crc32(0, zr_sub, zr_sublen), &zr_end, 1) == sum;
+    } else {
+        uint16_t check = crc_update(crc_update(0, zr_sub, zr_sublen), &zr_end, 1);
+        good = check == (zr_crc[0] << 8 | zr_crc[1]);
+    }
+    size_t len = zr_sublen;
+    zr_state = zr_end == ZCRCE || zr_end == ZCRCW ? ZR_IDLE : ZR_DATA;
+    zr_sublen = 0;
+
+    if (!good) {
+        naks_sent++;
+        if (++errors >= MAX_ERRORS) {
+            zmodem_abort("too many errors");
+            return;
+        }
+        zr_state = ZR_IDLE;
+        zr_rpos();
+        return;
+    }
+    errors = 0;
+
+    if (zr_frame == ZFILE) {
+        zr_file(zr_header[4] == 3);
+        zr_state = ZR_IDLE;
+        return;
+    }
+
+    if (file_len + len > file_cap) {
+        file_cap = (file_len + len) * 2;
+        file_data = realloc(file_data, file_cap);
+    }
+    memcpy(file_data + file_len, zr_sub, len);
+    file_len += len;
+
+    if (interrupt_at && file_len - zr_resumed >= (size_t)interrupt_at) {
+        // keep what came, as rz does, so a resume has something to go on
+        printf("sim: interrupted after %zu bytes\n", file_len - zr_resumed);
+        fflush(stdout);
+        file_size = file_len;
+        file_finish();
+        interrupt_at = 0;
+        target_puts("\x18\x18\x18\x18\x18\x18\x18\x18\x08\x08\x08\x08\x08\x08\x08\x08");
+        rx_deadline = 0;
+        target = TARGET_MONITOR;
+        return;
+    }
+    if (zr_end == ZCRCQ || zr_end == ZCRCW) {
+        if (drop_rate > 0 && chance() < drop_rate) {
+            acks_dropped++;
+        } else {
+            zr_send(ZACK, file_len);
+        }
+    }
+}
+static void zr_got_header(void)
+{
+    uint8_t type = zr_header[0];
+    uint32_t pos = zr_header[1] | zr_header[2] << 8 | zr_header[3] << 16 | (uint32_t)zr_header[4] << 24;
+    zr_crc32 = zr_kind == 'C';
+    zr_frame = 0;
+
+    switch (type) {
+        case ZRQINIT:
+            zr_rinit();
+            break;
+        case ZFILE:
+            zr_frame = ZFILE;
+            zr_state = ZR_DATA;
+            zr_sublen = 0;
+            break;
+        case ZDATA:
+            if (file_data == NULL) break;
+            if (pos != file_len) {
+                // data from before the last ZRPOS: ask again
+                zr_rpos();
+                break;
+            }
+            zr_frame = ZDATA;
+            zr_state = ZR_DATA;
+            zr_sublen = 0;
+            break;
+        case ZEOF:
+            if (file_data == NULL || pos != file_len) break;
+            file_size = file_len;
+            batch_bytes -= zr_resumed;
+            file_finish();
+            zr_rinit();
+            break;
+        case ZFIN:
+            zr_send(ZFIN, 0);
+            report("zmodem", batch_bytes, now_us() - batch_started);
+            transfers_ok++;
+            rx_deadline = 0;
+            target = TARGET_MONITOR;
+            break;
+    }
+}
+
+static void zmodem_byte(uint8_t byte)
+{
+    // ZDLE is CAN, but never five in a row inside a frame
+    if (byte == 0x18 && ++cans >= 5) {
+        printf("sim: sender cancelled\n");
+        fflush(stdout);
+        if (batch_started) transfers_failed++;
+        free(file_data);
+        file_data = NULL;
+        rx_deadline = 0;
+        target = TARGET_MONITOR;
+        return;
+    }
+    if (byte != 0x18) cans = 0;
+    rx_deadline = now_us() + (file_data ? timeout_us : 1000000);
+
+    // binary headers, subpackets and their CRCs are ZDLE-escaped
+    if (zr_state >= ZR_HEADER && !(zr_state == ZR_HEADER && zr_kind == 'B')) {
+        if (zr_escape) {
+            zr_escape = 0;
+            if (zr_state == ZR_DATA && byte >= ZCRCE && byte <= ZCRCW) {
+                zr_end = byte;
+                zr_state = ZR_CRC;
+                zr_crclen = 0;
+                return;
+            }
+            byte = byte == 'l' ? 0x7f : byte == 'm' ? 0xff : byte ^ 0x40;
+        } else if (byte == 0x18) {
+            zr_escape = 1;
+            return;
+        } else if (byte == 0x11 || byte == 0x13 || byte == 0x91 || byte == 0x93) {
+            // flow control characters are noise inside a frame
+            return;
+        }
+    }
+
+    switch (zr_state) {
+        case ZR_IDLE:
+            if (byte == '*') zr_state = ZR_PAD;
+            break;
+        case ZR_PAD:
+            if (byte == 0x18) {
+                zr_state = ZR_DLE;
+            } else if (byte != '*') {
+                zr_state = ZR_IDLE;
+            }
+            break;
+        case ZR_DLE:
+            zr_kind = byte;
+            zr_len = 0;
+            zr_escape = 0;
+            zr_need = byte == 'B' ? 14 : byte == 'A' ? 7 : 9;
+            zr_state = byte == 'A' || byte == 'B' || byte == 'C' ? ZR_HEADER : ZR_IDLE;
+            break;
+        case ZR_HEADER:
+            if (zr_kind == 'B') {
+                int v = byte >= '0' && byte <= '9' ? byte - '0' : byte >= 'a' && byte <= 'f' ? byte - 'a' + 10 : -1;
+                if (v < 0) {
+                    zr_state = ZR_IDLE;
+                    break;
+                }
+                uint8_t *b = &zr_header[zr_len / 2];
+                *b = zr_len % 2 ? (*b << 4) | v : v;
+            } else {
+                zr_header[zr_len] = byte;
+            }
+            if (++zr_len < zr_need) break;
+            zr_state = ZR_IDLE;
+            if (zr_kind == 'C') {
+                uint32_t sum = zr_header[5] | zr_header[6] << 8 | zr_header[7] << 16 | (uint32_t)zr_header[8] << 24;
+                if (crc32(0, zr_header, 5) != sum) break;
+            } else if (crc_update(0, zr_header, 7) != 0) {
+                break;
+            }
+            zr_got_header();
+            break;
+        case ZR_DATA:
+            if (zr_sublen == sizeof(zr_sub)) {
+                // a runaway subpacket: its end was lost
+                zr_state = ZR_IDLE;
+                zr_rpos();
+                break;
+            }
+            zr_sub[zr_sublen++] = byte;
+            break;
+        case ZR_CRC:
+            zr_crc[zr_crclen++] = byte;
+            if (zr_crclen == (zr_crc32 ? 4 : 2)) zr_subpacket();
+            break;
+    }
+}
+
+static void zmodem_timeout(void)
+{
+    if (++errors >= MAX_ERRORS) {
+        zmodem_abort("timed out");
+        return;
+    }
+    zr_state = ZR_IDLE;
+    if (file_data) {
+        zr_rpos();
+    } else {
+        zr_rinit();
+    }
+}
+
+// YModem-1K sender, the far end of scomm's receive: one file, then the empty block 0 that ends the batch
+static void sb_packet(uint8_t seqno, const uint8_t *data, size_t count, size_t size)
+{
+    sb_block[0] = size == 1024 ? 2 : 1;
+    sb_block[1] = seqno;
+    sb_block[2] = ~seqno;
+    memset(sb_block + 3, seqno == 0 ? 0 : 0x1a, size);
+    memcpy(sb_block + 3, data, count);
+    uint16_t sum = crc(sb_block + 3, size);
+    sb_block[3 + size] = sum >> 8;
+    sb_block[3 + size + 1] = sum & 0xff;
+    sb_len = 3 + size + 2;
+    sb_count = count;
+}
+
+// corruption hits the blocks on their way to scomm, as the line would
+static void sb_transmit(void)
+{
+    uint8_t out[sizeof(sb_block)];
+    memcpy(out, sb_block, sb_len);
+    for (size_t i = 0; i < sb_len; i++) {
+        if (corrupt_rate > 0 && chance() < corrupt_rate) {
+            out[i] ^= 1 << (random() % 8);
+            corrupted++;
+        }
+    }
+    target_send(out, sb_len);
+    rx_deadline = now_us() + 3 * timeout_us;
+}
+
+// frame the next data block: 1K, or 128 bytes once that much is all that's left
+static void sb_next(void)
+{
+    size_t remain = send_len - send_offset;
+    size_t size = remain <= 128 ? 128 : 1024;
+    sb_packet(sb_seq++, send_data + send_offset, remain < size ? remain : size, size);
+}
+
+static void send_start(void)
+{
+    FILE *f = fopen(send_path, "rb");
+    if (!f) {
+        perror(send_path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    send_len = ftell(f);
+    rewind(f);
+    free(send_data);
+    send_data = malloc(send_len ? send_len : 1);
+    if (fread(send_data, 1, send_len, f) != send_len) {
+        perror(send_path);
+        fclose(f);
+        return;
+    }
+    fclose(f);
+
+    target = TARGET_SEND;
+    sb_state = SB_WAIT_C;
+    send_offset = 0;
+    batch_started = 0;
+    naks_sent = acks_dropped = duplicates = corrupted = 0;
+    errors = 0;
+    cans = 0;
+    rx_deadline = now_us() + 20 * timeout_us;
+}
+
+static void send_abort(const char *why)
+{
+    printf("sim: transfer aborted: %s\n", why);
+    fflush(stdout);
+    target_puts("\x18\x18");
+    transfers_failed++;
+    rx_deadline = 0;
+    target = TARGET_MONITOR;
+}
+
+static void send_byte(uint8_t byte)
+{
+    if (byte == 0x18) {
+        if (++cans >= 2) {
+            printf("sim: receiver cancelled\n");
+            fflush(stdout);
+            transfers_failed++;
+            rx_deadline = 0;
+            target = TARGET_MONITOR;
+        }
+        return;
+    }
+    cans = 0;
+
+    if (byte == 0x15 && sb_state != SB_WAIT_C && sb_state != SB_WAIT_START && sb_state != SB_FINAL_C) {
+        naks_sent++;
+        if (++errors >= MAX_ERRORS) {
+            send_abort("too many errors");
+            return;
+        }
+        duplicates++;
+        if (sb_state == SB_EOT_ACK) {
+            target_byte(4);
+            rx_deadline = now_us() + 3 * timeout_us;
+        } else {
+            sb_transmit();
+        }
+        return;
+    }
+
+    switch (sb_state) {
+        case SB_WAIT_C:
+            if (byte == 'C') {
+                // block 0: name, NUL, decimal length
+                char header[128] = { 0 };
+                const char *name = strrchr(send_path, '/') ? strrchr(send_path, '/') + 1 : send_path;
+                int len = snprintf(header, sizeof(header) - 1, "%s", name);
+                snprintf(header + len + 1, sizeof(header) - len - 1, "%zu", send_len);
+                sb_packet(0, (uint8_t *)header, sizeof(header), 128);
+                batch_started = now_us();
+                sb_transmit();
+                sb_state = SB_HEADER_ACK;
+            }
+            break;
+        case SB_HEADER_ACK:
+            if (byte == 6) {
+                errors = 0;
+                sb_seq = 1;
+                sb_state = SB_WAIT_START;
+            }
+            break;
+        case SB_WAIT_START:
+            if (byte == 'C') {
+                if (send_len == 0) {
+                    target_byte(4);
+                    sb_state = SB_EOT_ACK;
+                } else {
+                    sb_next();
+                    sb_transmit();
+                    sb_state = SB_DATA_ACK;
+                }
+            }
+            break;
+        case SB_DATA_ACK:
+            if (byte == 6) {
+                errors = 0;
+                send_offset += sb_count;
+                if (send_offset < send_len) {
+                    sb_next();
+                    sb_transmit();
+                } else {
+                    target_byte(4);
+                    rx_deadline = now_us() + 3 * timeout_us;
+                    sb_state = SB_EOT_ACK;
+                }
+            }
+            break;
+        case SB_EOT_ACK:
+            if (byte == 6) {
+                errors = 0;
+                sb_state = SB_FINAL_C;
+            }
+            break;
+        case SB_FINAL_C:
+            if (byte == 'C') {
+                sb_packet(0, NULL, 0, 128);
+                sb_transmit();
+                sb_state = SB_END_ACK;
+            }
+            break;
+        case SB_END_ACK:
+            if (byte == 6) {
+                report("dump", send_len, now_us() - batch_started);
+                transfers_ok++;
+                rx_deadline = 0;
+                target = TARGET_MONITOR;
+            }
+            break;
+    }
+}
+
+static void send_timeout(void)
+{
+    // the receiver went quiet: send the block again, or give up
+    if (++errors >= MAX_ERRORS) {
+        send_abort("timed out");
+        return;
+    }
+    switch (sb_state) {
+        case SB_HEADER_ACK:
+        case SB_DATA_ACK:
+        case SB_END_ACK:
+            duplicates++;
+            sb_transmit();
+            break;
+        case SB_EOT_ACK:
+            target_byte(4);
+            rx_deadline = now_us() + 3 * timeout_us;
+            break;
+        default:
+            rx_deadline = now_us() + 3 * timeout_us;
+            break;
+    }
+}
+
+static void buggy_start(void)
+{
+    target = TARGET_BUGGY;
+    buggy_state = BUGGY_START;
+    buggy_started = now_us();
+    buggy_ready_at = buggy_started + start_us;
+    buggy_hdr_idx = 0;
+    buggy_holding = 0;
+    buggy_len = 0;
+    buggy_overruns = 0;
+    naks_sent = acks_dropped = duplicates = corrupted = 0;
+    rx_deadline = buggy_ready_at;
+}
+
+// the bootrom receiver picks a byte up from the UART at `at`, then is busy with it a while
+static void buggy_take(uint8_t byte, int64_t at)
+{
+    static const uint8_t header[3] = { 0x01, 0x00, 0xff };
+
+    switch (buggy_state) {
+        case BUGGY_START:
+        case BUGGY_HEADER:
+            if (buggy_hdr_idx == 0 ? (byte == 1 || byte == 2) : byte == header[buggy_hdr_idx]) {
+                buggy_hdr_idx++;
+                buggy_state = buggy_hdr_idx == 3 ? BUGGY_DATA : BUGGY_HEADER;
+            } else {
+                buggy_state = BUGGY_PURGE;
+            }
+            // the header is checked against the block type, which takes it a while longer
+            buggy_ready_at = at + 5 * gap_us;
+            break;
+        case BUGGY_DATA:
+            if (buggy_len < sizeof(buggy_data)) buggy_data[buggy_len++] = byte;
+            buggy_ready_at = at + gap_us;
+            break;
+        case BUGGY_PURGE:
+            buggy_ready_at = at + gap_us;
+            break;
+    }
+    rx_deadline = at + 200000;
+}
+
+// the bootrom receiver polls the UART between slow bits of work; the UART holds one byte for it, and a byte
+// that lands while that one is still waiting overruns it and is lost
+static void buggy_byte(uint8_t byte, int64_t now)
+{
+    if (buggy_state == BUGGY_NAKED) {
+        if (byte == 0x18 && ++cans >= 2) {
+            int ok = buggy_overruns == 0 && buggy_len > 0;
+            if (ok && expect_patch) {
+                FILE *f = fopen(expect_patch, "r");
+                uint8_t expected[2048];
+                size_t size = f ? fread(expected, 1, sizeof(expected), f) : 0;
+                if (f) fclose(f);
+                ok = size == buggy_len && memcmp(expected, buggy_data, size) == 0;
+            }
+            if (ok) {
+                report("patch", buggy_len, now - buggy_started);
+                transfers_ok++;
+                patched = 1;
+            } else {
+                printf("sim: patch corrupt, %zu bytes with %u lost\n", buggy_len, buggy_overruns);
+                fflush(stdout);
+                transfers_failed++;
+            }
+            target = TARGET_MONITOR;
+            if (patched && autostart) receive_start();
+        }
+        return;
+    }
+
+    // nothing polls the UART until the receiver has started
+    if (buggy_state == BUGGY_START && now < buggy_ready_at) return;
+
+    // the receiver got round to the held byte before this one landed
+    if (buggy_holding && now >= buggy_ready_at) {
+        buggy_holding = 0;
+        buggy_take(buggy_held, buggy_ready_at);
+    }
+    if (now >= buggy_ready_at) {
+        buggy_take(byte, now);
+    } else if (!buggy_holding) {
+        buggy_held = byte;
+        buggy_holding = 1;
+    } else {
+        buggy_overruns++;
+    }
+}
+
+static void buggy_timeout(void)
+{
+    if (buggy_holding) {
+        // the last byte is still to be picked up, and the wait starts over from it
+        buggy_holding = 0;
+        buggy_take(buggy_held, buggy_ready_at);
+        return;
+    }
+    if (buggy_state == BUGGY_START) {
+        // like any YModem receiver, the bootrom asks for a CRC block until one comes
+        target_byte('C');
+        rx_deadline = now_us() + 1000000;
+    } else if (buggy_state == BUGGY_PURGE || (buggy_state == BUGGY_HEADER && buggy_hdr_idx > 0)) {
+        // the line's gone quiet on a block it couldn't make out: NAK and wait for it again
+        nak();
+        buggy_state = BUGGY_HEADER;
+        buggy_hdr_idx = 0;
+        buggy_len = 0;
+        buggy_overruns = 0;
+    } else if (buggy_state == BUGGY_DATA) {
+        // the block never got its CRC, so it's a NAK; the patch is already in place
+        nak();
+        buggy_state = BUGGY_NAKED;
+        cans = 0;
+    }
+}
+
+static void monitor_byte(uint8_t byte)
+{
+    if (byte == 'y') {
+        if (patched) {
+            receive_start();
+        } else {
+            buggy_start();
+        }
+        return;
+    }
+    if (byte == '\r') {
+        int rz = zmodem && monitor_len == 2 && memcmp(monitor_line, "rz", 2) == 0;
+        int sb = send_path && monitor_len == 2 && memcmp(monitor_line, "sb", 2) == 0;
+        monitor_len = 0;
+        if (rz) {
+            target_puts("\r\n");
+            zmodem_start();
+            return;
+        }
+        if (sb) {
+            target_puts("\r\n");
+            send_start();
+            if (target == TARGET_SEND) return;
+        }
+        target_puts("\r\nTRS-20> ");
+    } else if (byte >= ' ' && byte < 0x7f) {
+        if (monitor_len < sizeof(monitor_line)) monitor_line[monitor_len++] = byte;
+        target_byte(byte);
+    }
+}
+
+static void target_input(uint8_t byte, int64_t now)
+{
+    // sending, the corruption goes on the blocks instead
+    if (target != TARGET_SEND && corrupt_rate > 0 && chance() < corrupt_rate) {
+        byte ^= 1 << (random() % 8);
+        corrupted++;
+    }
+
+    switch (target) {
+        case TARGET_MONITOR:
+            monitor_byte(byte);
+            break;
+        case TARGET_ZMODEM:
+            zmodem_byte(byte);
+            break;
+        case TARGET_BUGGY:
+            buggy_byte(byte, now);
+            break;
+        case TARGET_RECEIVE:
+            receive_byte(byte);
+            break;
+        case TARGET_SEND:
+            send_byte(byte);
+            break;
+    }
+}
+
+static void target_deadline(int64_t now)
+{
+    if (rx_deadline == 0 || now < rx_deadline) return;
+    rx_deadline = 0;
+    if (target == TARGET_BUGGY) {
+        buggy_timeout();
+    } else if (target == TARGET_RECEIVE) {
+        receive_timeout();
+    } else if (target == TARGET_ZMODEM) {
+        zmodem_timeout();
+    } else if (target == TARGET_SEND) {
+        send_timeout();
+    }
+}
+
+// the host side is only read as fast as the line could carry it, so scomm sees flow control
+static void *line_receive(void *unused)
+{
+    double credit = 0;
+    int64_t credit_at = now_us();
+    uint8_t buffer[4096];
+
+    while (!rx_stop) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        if (poll(&pfd, 1, POLL_INTERVAL) <= 0) continue;
+
+        int64_t now = now_us();
+        if (baud) {
+            credit += (now - credit_at) * baud / 10e6;
+            if (credit > 64) credit = 64;
+        } else {
+            credit = sizeof(buffer);
+        }
+        credit_at = now;
+        if (credit < 1) {
+            usleep((1 - credit) * 10e6 / baud + 1);
+            continue;
+        }
+
+        ssize_t got = read(master, buffer, credit < sizeof(buffer) ? (size_t)credit : sizeof(buffer));
+        if (got <= 0) continue;
+        credit -= got;
+
+        // bytes read together still crossed the line one character time apart
+        now = now_us();
+        pthread_mutex_lock(&rx_lock);
+        for (ssize_t i = 0; i < got; i++) {
+            int64_t start = rx_free_at > now ? rx_free_at : now;
+            rx_free_at = start + (baud ? 10000000 / baud : 0);
+            queue_push(&to_target, buffer[i], rx_free_at + latency_us);
+        }
+        pthread_mutex_unlock(&rx_lock);
+        if (write(wake_pipe[1], "", 1) < 0 && errno != EAGAIN) perror("wake pipe");
+    }
+    return NULL;
+}
+
+// the line is idle once everything scomm wrote has reached the target
+static int line_idle(void)
+{
+    pthread_mutex_lock(&rx_lock);
+    int idle = queue_empty(&to_target) && rx_free_at <= now_us();
+    pthread_mutex_unlock(&rx_lock);
+    return idle;
+}
+
+// deliver whatever is due each way across the line; returns when there's next something to do
+static int64_t line_service(void)
+{
+    int64_t now = now_us();
+    int64_t wake = now + POLL_INTERVAL * 1000;
+
+    // the target sees each byte when it arrived, however late the sim woke to deliver it
+    pthread_mutex_lock(&rx_lock);
+    while (!queue_empty(&to_target) && to_target.q[to_target.head].due <= now) {
+        line_byte *arrived = &to_target.q[to_target.head];
+        to_target.head = (to_target.head + 1) % QUEUE_SIZE;
+        target_input(arrived->byte, arrived->due);
+    }
+    if (!queue_empty(&to_target) && to_target.q[to_target.head].due < wake) wake = to_target.q[to_target.head].due;
+    pthread_mutex_unlock(&rx_lock);
+
+    target_deadline(now);
+    if (rx_deadline && rx_deadline < wake) wake = rx_deadline;
+
+    while (!queue_empty(&to_host) && to_host.q[to_host.head].due <= now) {
+        if (write(master, &to_host.q[to_host.head].byte, 1) != 1) break;
+        to_host.head = (to_host.head + 1) % QUEUE_SIZE;
+    }
+    if (!queue_empty(&to_host) && to_host.q[to_host.head].due < wake) wake = to_host.q[to_host.head].due;
+
+    return wake;
+}
+
+static int open_pty(char *name, size_t size)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master == -1 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("can't create pty");
+        return -1;
+    }
+    snprintf(name, size, "%s", ptsname(master));
+
+    // hold the slave open so the master never sees a hangup between clients, and keep it raw
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        perror(name);
+        return -1;
+    }
+    struct termios config;
+    tcgetattr(slave, &config);
+    cfmakeraw(&config);
+    tcsetattr(slave, TCSANOW, &config);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+static pid_t spawn(char **argv, const char *pty)
+{
+    for (int i = 0; argv[i]; i++) {
+        if (strcmp(argv[i], "{}") == 0) argv[i] = (char *)pty;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        if (!verbose) {
+            dup2(null, STDOUT_FILENO);
+        }
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return pid;
+}
+
+static volatile int quitit = 0;
+static void sigint(int _unused)
+{
+    quitit = 1;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-m buggy|patched] [-a] [-G] [-z] [-i interrupt_bytes] [-S send_file] [-b baud] [-l latency_ms]\n"
+                    "       [-c corrupt_rate] [-d drop_ack_rate] [-g byte_gap_us] [-t timeout_ms] [-p expected_patch]\n"
+                    "       [-o outdir] [-s seed] [-v] [-- command {} ...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char * argv[])
+{
+    long seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:aGzi:S:b:l:c:d:g:t:p:o:s:v")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "patched") == 0) patched = 1;
+                else if (strcmp(optarg, "buggy") == 0) patched = 0;
+                else usage(argv[0]);
+                break;
+            case 'a': autostart = 1; break;
+            case 'G': want_g = 1; break;
+            case 'z': zmodem = 1; break;
+            case 'i': interrupt_at = strtol(optarg, NULL, 10); break;
+            case 'S': send_path = optarg; break;
+            case 'b': baud = strtol(optarg, NULL, 10); break;
+            case 'l': latency_us = strtod(optarg, NULL) * 1000; break;
+            case 'c': corrupt_rate = strtod(optarg, NULL); break;
+            case 'd': drop_rate = strtod(optarg, NULL); break;
+            case 'g': gap_us = strtol(optarg, NULL, 10); break;
+            case 't': timeout_us = strtol(optarg, NULL, 10) * 1000; break;
+            case 'p': expect_patch = optarg; break;
+            case 'o': outdir = optarg; break;
+            case 's': seed = strtol(optarg, NULL, 10); break;
+            case 'v': verbose = 1; break;
+            default: usage(argv[0]);
+        }
+    }
+    srandom(seed);
+
+    char pty[256];
+    if (open_pty(pty, sizeof(pty)) != 0) return 1;
+
+    signal(SIGINT, sigint);
+    signal(SIGTERM, sigint);
+
+    pid_t child = -1;
+    if (optind < argc) {
+        child = spawn(argv + optind, pty);
+    } else {
+        printf("%s\n", pty);
+        fflush(stdout);
+    }
+
+    target_puts("TRS-20 monitor\r\nTRS-20> ");
+    if (send_path && autostart) {
+        send_start();
+    } else if (zmodem && autostart) {
+        zmodem_start();
+    } else if (patched && autostart) {
+        receive_start();
+    }
+
+    int status = 0;
+    pthread_t reader;
+    if (pipe(wake_pipe) != 0 || pthread_create(&reader, NULL, line_receive, NULL) != 0) {
+        perror("can't start the line");
+        return 1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    while (!quitit) {
+        int64_t wake = line_service();
+        int64_t now = now_us();
+
+        struct pollfd pfd = { wake_pipe[0], POLLIN, 0 };
+        int timeout = wake > now ? (int)((wake - now + 999) / 1000) : 0;
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint8_t nudges[64];
+            while (read(wake_pipe[0], nudges, sizeof(nudges)) > 0) continue;
+        }
+
+        if (child > 0 && waitpid(child, &status, WNOHANG) == child) {
+            // let the last bytes the command wrote reach the target before reporting
+            int64_t until = now_us() + latency_us + 500000;
+            while (now_us() < until) {
+                int64_t wake = line_service();
+                if (line_idle()) break;
+                now = now_us();
+                if (wake > now) usleep(wake - now);
+            }
+            break;
+        }
+    }
+    rx_stop = 1;
+    pthread_join(reader, NULL);
+
+    if (child > 0 && quitit) {
+        kill(child, SIGTERM);
+        waitpid(child, &status, 0);
+    }
+
+    printf("sim: %d transfers complete, %d failed", transfers_ok, transfers_failed);
+    if (child > 0) printf(", command exited %d", WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    printf("\n");
+
+    return transfers_failed || (child > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) ? 1 : 0;
+}
@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trs20.h"
+#include "image.h"
+#include "capture.h"
+#include "ymodem.h"
+
+#define YM_TURN_INIT            1.0             // receiver turnaround assumed until one has been timed, in seconds
+#define YM_TURN_MIN             0.02            // floor on the turnaround allowance
+#define YM_BACKOFF_MAX          10.0            // ceiling on a backed-off turnaround allowance
+#define YM_MAX_RETRIES          10              // resends of one packet before the transfer is cancelled
+#define YM_START_TIMEOUT        60.0            // wait for the receiver's first C
+#define YM_NEXT_TIMEOUT         30.0            // wait for the C that follows block 0 or EOT
+
+static const char *const ymodem_state_names[] = {
+    "wait_c", "metadata", "meta_ack", "wait_start", "filedata", "data_ack",
+    "eot", "eot_ack", "final_c", "terminating", "final_ack", "cancel", "done",
+};
+
+// frame the first `size` bytes of the payload as a packet, SOH for 128 bytes and STX for 1024
+static void ymodem_frame(ym_block *block, uint8_t seqno, size_t size)
+{
+    uint16_t sum = crc(block->packet.payload, size);
+    block->packet.type = size == YM_BLOCK_1K ? YM_STX : YM_SOH;
+    block->packet.seqno = seqno;
+    block->packet.seqcpl = ~seqno;
+    block->packet.payload[size] = sum >> 8;
+    block->packet.payload[size + 1] = sum & 0xff;
+    block->len = 3 + size + 2;
+}
+
+// frame the packet that follows the one in flight, so an ACK can go straight to transmitting it
+static void ymodem_prepare(ymodem_state *state)
+{
+    ym_block *next = state->next;
+    size_t remain = state->src.size - state->offset;
+
+    if (remain == 0) {
+        // the null metadata block that ends the batch, sent after EOT is acknowledged
+        memset(next->packet.payload, 0, YM_BLOCK);
+        ymodem_frame(next, 0, YM_BLOCK);
+        next->data_len = 0;
+        state->next_state = YMODEM_EOT;
+    } else {
+        // a short tail goes in a 128-byte block rather than padding out a whole 1K block
+        size_t size = remain <= YM_BLOCK ? YM_BLOCK : state->block_size;
+        size_t count = remain < size ? remain : size;
+        memcpy(next->packet.payload, state->src.data + state->offset, count);
+        memset(next->packet.payload + count, 0x1a, size - count);
+        ymodem_frame(next, state->next_seqno++, size);
+        next->data_len = count;
+        state->offset += count;
+        state->next_state = YMODEM_FILEDATA;
+    }
+    state->next_ready = 1;
+}
+
+static int ymodem_start_file(ymodem_state *state);
+static void ymodem_free(ymodem_state *state);
+
+// make the prepared packet the one in flight
+static void ymodem_advance(ymodem_state *state)
+{
+    if (!state->next_ready) ymodem_prepare(state);
+
+    ym_block *sent = state->packet;
+    state->packet = state->next;
+    state->next = sent;
+    state->next_ready = 0;
+    state->packet_idx = 0;
+    state->state = state->next_state;
+}
+
+// the receiver answered the packet in flight: time the round trip, unless a resend makes it ambiguous
+static void ymodem_acked(ymodem_state *state, uint64_t payload)
+{
+    if (state->retries == 0 && state->stats.sent_at != 0) {
+        double wire = (state->stats.wire_tx - state->acked_tx) * 10.0 / state->baud;
+        double turn = stats_now() - state->stats.sent_at - wire;
+        if (turn < 0) turn = 0;
+        state->turn_sum += turn;
+        if (state->rtt_count++ == 0) {
+            state->srtt = turn;
+            state->rttvar = turn / 2;
+        } else {
+            double err = turn - state->srtt;
+            state->rttvar += ((err < 0 ? -err : err) - state->rttvar) / 4;
+            state->srtt += err / 8;
+        }
+    }
+    state->retries = 0;
+    state->acked_tx = state->stats.wire_tx;
+    stats_acked(&state->stats, payload);
+}
+
+// how long to wait for the response: the wire time of everything unanswered, plus the receiver's
+// turnaround, doubled for each resend of the packet
+static double ymodem_rto(ymodem_state *state)
+{
+    double wire = (state->stats.wire_tx - state->acked_tx) * 10.0 / state->baud;
+    double turn = state->rtt_count ? state->srtt + 4 * state->rttvar : YM_TURN_INIT;
+    if (turn < YM_TURN_MIN) turn = YM_TURN_MIN;
+    for (int i = 0; i < state->retries && turn < YM_BACKOFF_MAX; i++) turn *= 2;
+    if (turn > YM_BACKOFF_MAX) turn = YM_BACKOFF_MAX;
+    return wire + turn;
+}
+
+// set the deadline for the state just entered; only the states that wait on the receiver have one
+static void ymodem_arm(ymodem_state *state)
+{
+    switch (state->state) {
+        case YMODEM_WAIT_C:
+            state->deadline = stats_now() + YM_START_TIMEOUT;
+            break;
+        case YMODEM_WAIT_START:
+        case YMODEM_FINAL_C:
+            state->deadline = stats_now() + YM_NEXT_TIMEOUT;
+            break;
+        case YMODEM_DATA_ACK:
+            if (state->streaming) {
+                state->deadline = 0;
+                break;
+            }
+            // fall through
+        case YMODEM_META_ACK:
+        case YMODEM_EOT_ACK:
+        case YMODEM_FINAL_ACK:
+            state->deadline = stats_now() + ymodem_rto(state);
+            break;
+        default:
+            state->deadline = 0;
+            break;
+    }
+}
+
+// send the packet in flight again from `resend`, or give up on it after YM_MAX_RETRIES
+static void ymodem_resend(ymodem_state *state, int resend)
+{
+    state->stats.retransmits++;
+    state->packet_idx = 0;
+    if (++state->retries > YM_MAX_RETRIES) {
+        printf("\nno response after %d retries, cancelling\n", YM_MAX_RETRIES);
+        state->state = YMODEM_CANCEL;
+    } else {
+        state->state = resend;
+    }
+}
+
+// a data block got through: count it and draw the progress line
+static void ymodem_delivered(ymodem_state *state)
+{
+    state->stats.blocks++;
+    if (state->streaming) {
+        // nothing answers a YModem-G block, so there's no round trip to time
+        stats_acked(&state->stats, state->packet->data_len);
+    } else {
+        ymodem_acked(state, state->packet->data_len);
+    }
+    stats_progress(&state->stats);
+}
+
+// EOT was acknowledged: get the next file's block 0 ready while the receiver closes this one
+static void ymodem_next_file(ymodem_state *state)
+{
+    ymodem_acked(state, 0);
+    image_unload(&state->src);
+    state->batch_more = 0;
+    while (!state->batch_more && ++state->file_idx < state->file_count) {
+        state->batch_more = ymodem_start_file(state);
+    }
+    state->state = YMODEM_FINAL_C;
+}
+
+static int ymodem_step(ymodem_state *state, uint8_t input)
+{
+
+    // Process CANcel bytes first
+    if (input == 0x18) {
+        state->stats.cans++;
+        if (++state->cans >= 2) {
+            return 0;
+        } else {
+            return 1;
+        }
+    } else {
+        state->cans = 0;
+    }
+
+    switch (state->state) {
+        case YMODEM_WAIT_C:
+            if (input == 'C' || input == 'G') {
+                state->streaming = input == 'G';
+                state->state = YMODEM_METADATA;
+            }
+            break;
+        case YMODEM_META_ACK:
+            if (input == 6) {
+                ymodem_acked(state, 0);
+                state->state = YMODEM_WAIT_START;
+            } else if (input == 'G' && state->streaming) {
+                // a YModem-G receiver can answer block 0 with just its G, the ACK and the go-ahead in one
+                ymodem_acked(state, 0);
+                ymodem_advance(state);
+            } else if (input == 'C' || input == 'G') {
+                ymodem_resend(state, YMODEM_METADATA);
+            }
+            break;
+        case YMODEM_WAIT_START:
+            if (input == 'C' || input == 'G')
+                ymodem_advance(state);
+            break;
+        case YMODEM_FILEDATA:
+        case YMODEM_DATA_ACK:
+            if (state->streaming) {
+                // YModem-G has no retransmission, so a NAK ends the transfer; stray ACKs are ignored
+                if (input == 0x15) {
+                    state->stats.naks++;
+                    printf("NAK during YModem-G transfer, aborting\n");
+                    state->packet_idx = 0;
+                    state->state = YMODEM_CANCEL;
+                }
+            } else if (state->state == YMODEM_DATA_ACK) {
+                if (input == 6) {
+                    ymodem_delivered(state);
+                    ymodem_advance(state);
+                } else if (input == 0x15) {
+                    state->stats.naks++;
+                    ymodem_resend(state, YMODEM_FILEDATA);
+                }
+            }
+            break;
+        case YMODEM_EOT_ACK:
+            if (input == 6) {
+                ymodem_next_file(state);
+            } else if (input == 'C' || input == 'G') {
+                // the receiver has closed the file and wants the next one, so its ACK went missing
+                ymodem_next_file(state);
+                state->state = state->batch_more ? YMODEM_METADATA : YMODEM_TERMINATING;
+            } else if (input == 0x15) {
+                state->stats.naks++;
+                ymodem_resend(state, YMODEM_EOT);
+            }
+            break;
+        case YMODEM_FINAL_C:
+            if (input == 'C' || input == 'G')
+                state->state = state->batch_more ? YMODEM_METADATA : YMODEM_TERMINATING;
+            break;
+        case YMODEM_FINAL_ACK:
+            if (input == 6) {
+                ymodem_acked(state, 0);
+                state->completed = 1;
+                return 0;
+            } else if (input == 0x15) {
+                state->stats.naks++;
+                ymodem_resend(state, YMODEM_TERMINATING);
+            }
+            break;
+    }
+
+    return 1;
+}
+
+int ymodem_input(ymodem_state *state, uint8_t input)
+{
+    int entered = state->state;
+    state->stats.wire_rx++;
+    int running = ymodem_step(state, input);
+    if (state->state != entered) ymodem_arm(state);
+    stats_state(&state->stats, state->state);
+    return running;
+}
+
+void ymodem_timeout(ymodem_state *state)
+{
+    // an ACK or C that came in since the timer was armed has moved the deadline on, or cleared it
+    if (!stats_expired(state->deadline)) return;
+
+    state->stats.timeouts++;
+    switch (state->state) {
+        case YMODEM_META_ACK:
+            ymodem_resend(state, YMODEM_METADATA);
+            break;
+        case YMODEM_DATA_ACK:
+            ymodem_resend(state, YMODEM_FILEDATA);
+            break;
+        case YMODEM_EOT_ACK:
+            ymodem_resend(state, YMODEM_EOT);
+            break;
+        case YMODEM_FINAL_ACK:
+            ymodem_resend(state, YMODEM_TERMINATING);
+            break;
+        default:
+            // nothing to resend: it's the receiver's move, and it hasn't made one
+            printf("\nreceiver timed out in %s, cancelling\n", ymodem_state_names[state->state]);
+            state->packet_idx = 0;
+            state->state = YMODEM_CANCEL;
+            break;
+    }
+    ymodem_arm(state);
+    stats_state(&state->stats, state->state);
+}
+
+// write to the line, counting what went and copying it to the capture
+static ssize_t ymodem_send(ymodem_state *state, int fd, const void *data, size_t size)
+{
+    ssize_t sent = write(fd, data, size);
+    if (sent > 0) {
+        state->stats.wire_tx += sent;
+        if (state->capture) capture_put(state->capture, CAPTURE_TX, data, sent);
+    }
+    return sent;
+}
+
+// push as much of the packet in flight as the tty will take, moving to `next` once it's all gone
+static int ymodem_send_packet(ymodem_state *state, int fd, int next)
+{
+    uint8_t *buffer = (uint8_t *)&state->packet->packet;
+    ssize_t sent = ymodem_send(state, fd, buffer + state->packet_idx, state->packet->len - state->packet_idx);
+    if (sent > 0 && (state->packet_idx += sent) == state->packet->len) {
+        state->packet_idx = 0;      // reset to zero in case of retransmit
+        state->state = next;
+        stats_sent(&state->stats);
+        // the packet is in the tty's hands now, build the next one while the line drains
+        if (!state->next_ready && next != YMODEM_FINAL_ACK) ymodem_prepare(state);
+        // low latency: see the packet out of the driver now, so nothing stands between the ACK and the loop.
+        // The timing is unchanged: a driver can report the tty drained before the bytes are on the wire
+        if (state->drain && !state->streaming) tcdrain(fd);
+        return 0;
+    }
+    return 1;
+}
+
+static int ymodem_write(ymodem_state *state, int fd)
+{
+
+    uint8_t output;
+
+    switch (state->state) {
+        case YMODEM_METADATA:
+            return ymodem_send_packet(state, fd, YMODEM_META_ACK);
+        case YMODEM_FILEDATA:
+            if (!state->streaming)
+                return ymodem_send_packet(state, fd, YMODEM_DATA_ACK);
+            // YModem-G: go straight on to the next block, and keep the tty full
+            while (state->state == YMODEM_FILEDATA) {
+                if (ymodem_send_packet(state, fd, YMODEM_DATA_ACK))
+                    return 1;
+                ymodem_delivered(state);
+                ymodem_advance(state);
+            }
+            return ymodem_write(state, fd);
+        case YMODEM_EOT:
+            output = 4;
+            if (ymodem_send(state, fd, &output, 1) == 1) {
+                stats_sent(&state->stats);
+                state->state = YMODEM_EOT_ACK;
+                return 0;
+            }
+            return 1;
+        case YMODEM_CANCEL:
+            // two CANs, tracked through packet_idx so a full tty can't lose one
+            output = 0x18;
+            while (state->packet_idx < 2) {
+                if (ymodem_send(state, fd, &output, 1) != 1)
+                    return 1;
+                state->packet_idx++;
+            }
+            state->state = YMODEM_DONE;
+            return 0;
+        case YMODEM_TERMINATING:
+            return ymodem_send_packet(state, fd, YMODEM_FINAL_ACK);
+    }
+
+    return 0;
+}
+
+int ymodem_output(ymodem_state *state, int fd)
+{
+    int entered = state->state;
+    int blocked = ymodem_write(state, fd);
+    if (state->state != entered) ymodem_arm(state);
+    stats_state(&state->stats, state->state);
+    return blocked;
+}
+
+// load the current file of the batch, frame its block 0 as the packet in flight and its first data block as next
+static int ymodem_start_file(ymodem_state *state)
+{
+    char *filename = state->files[state->file_idx];
+    struct stat filestat;
+    if (!image_load(&state->src, filename, &filestat)) {
+        return 0;
+    }
+
+    // block 0: name, NUL, then decimal length and octal mtime so the receiver can trim the padding
+    char *path = strdup(filename);
+    uint8_t *payload = state->packet->packet.payload;
+    memset(payload, 0, YM_BLOCK_1K);
+    int namelen = snprintf((char *)payload, YM_BLOCK_1K - 1, "%s", basename(path));
+    if (namelen > YM_BLOCK_1K - 2) namelen = YM_BLOCK_1K - 2;
+    int metalen = snprintf((char *)payload + namelen + 1, YM_BLOCK_1K - namelen - 1, "%lld %llo",
+                           (long long)state->src.size, (long long)filestat.st_mtime);
+    free(path);
+
+    // a name too long for 128 bytes gets a 1K block 0, whatever the data block size
+    ymodem_frame(state->packet, 0, namelen + 1 + metalen < YM_BLOCK ? YM_BLOCK : YM_BLOCK_1K);
+    state->packet_idx = 0;
+    state->offset = 0;
+    state->next_seqno = 1;
+    printf("%s: %zu bytes, %d of %d\n", filename, state->src.size, state->file_idx + 1, state->file_count);
+
+    // have the first data block ready before the receiver asks for it
+    ymodem_prepare(state);
+
+    return 1;
+}
+
+int ymodem_open(ymodem_state *state, char **filenames, int count, size_t block_size, long baud, const char *json_path)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat filestat;
+        if (stat(filenames[i], &filestat) != 0) {
+            perror(filenames[i]);
+            return 0;
+        }
+        if (!S_ISREG(filestat.st_mode)) {
+            fprintf(stderr, "%s: not a regular file\n", filenames[i]);
+            return 0;
+        }
+        total += filestat.st_size;
+    }
+
+    state->files = malloc(count * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        state->files[i] = strdup(filenames[i]);
+    }
+    state->file_count = count;
+    state->state = YMODEM_WAIT_C;
+    state->block_size = block_size;
+    state->cans = 0;
+    state->streaming = 0;
+    state->completed = 0;
+    state->baud = baud;
+    state->retries = 0;
+    state->acked_tx = 0;
+    state->rtt_count = 0;
+    state->turn_sum = 0;
+    state->packet = &state->blocks[0];
+    state->next = &state->blocks[1];
+    state->src.data = NULL;
+    state->src.mapped = 0;
+    state->json_path = json_path ? strdup(json_path) : NULL;
+    state->stats.progress = 1;
+    stats_start(&state->stats, YMODEM_WAIT_C, total);
+    ymodem_arm(state);
+
+    for (state->file_idx = 0; state->file_idx < count; state->file_idx++) {
+        if (ymodem_start_file(state)) {
+            return 1;
+        }
+    }
+
+    ymodem_free(state);
+    return 0;
+}
+
+// release the batch without reporting on it
+static void ymodem_free(ymodem_state *state)
+{
+    image_unload(&state->src);
+    for (int i = 0; i < state->file_count; i++) {
+        free(state->files[i]);
+    }
+    free(state->files);
+    free(state->json_path);
+    state->files = NULL;
+    state->file_count = 0;
+    state->json_path = NULL;
+}
+
+void ymodem_close(ymodem_state *state)
+{
+    stats_finish(&state->stats, state->state);
+    stats_report(&state->stats, stdout);
+    if (state->rtt_count) {
+        printf("receiver turnaround avg %.1fms over %u blocks, wire time excluded\n",
+               state->turn_sum / state->rtt_count * 1e3, state->rtt_count);
+    }
+    if (state->json_path) {
+        stats_json(&state->stats, state->json_path, state->streaming ? "ymodem-g" : "ymodem",
+                   ymodem_state_names, sizeof(ymodem_state_names) / sizeof(ymodem_state_names[0]));
+    }
+    ymodem_free(state);
+}
@@ -0,0 +1,89 @@
+#ifndef YMODEM_H
+#define YMODEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "image.h"
+#include "stats.h"
+
+#define YMODEM_WAIT_C           0               // waiting for initial 'C'
+#define YMODEM_METADATA         1               // sending metadata packet
+#define YMODEM_META_ACK         2               // waiting for ACK
+#define YMODEM_WAIT_START       3               // waiting for file data C
+#define YMODEM_FILEDATA         4               // sending file data
+#define YMODEM_DATA_ACK         5               // waiting for ACK
+#define YMODEM_EOT              6               // sending EOT
+#define YMODEM_EOT_ACK          7               // waiting for ACK
+#define YMODEM_FINAL_C          8               // waiting for C to start next file
+#define YMODEM_TERMINATING      9               // sending NULL metadata
+#define YMODEM_FINAL_ACK        10              // waiting for final ACK
+#define YMODEM_CANCEL           11              // sending CANs to abort the transfer
+#define YMODEM_DONE             12              // transfer over, after a cancel
+
+#define YM_SOH                  0x01            // 128-byte block header
+#define YM_STX                  0x02            // 1024-byte block header
+#define YM_BLOCK                128             // standard block size
+#define YM_BLOCK_1K             1024            // YModem-1K block size
+
+typedef struct __attribute__((__packed__)) ym_packet
+{
+    uint8_t type;
+    uint8_t seqno;
+    uint8_t seqcpl;
+    uint8_t payload[YM_BLOCK_1K + 2];           // data, followed by the CRC
+} ym_packet;
+
+typedef struct ym_block
+{
+    ym_packet packet;
+    size_t len;                 // total bytes in the framed packet
+    size_t data_len;            // file bytes in the payload, padding excluded
+} ym_block;
+
+typedef struct ymodem_state
+{
+    int state;                  // YMODEM_XXX constant
+    char **files;               // the batch, sent in order in one session
+    int file_count;
+    int file_idx;               // index of the file being sent
+    int batch_more;             // a file's block 0 is framed for the C after this file's EOT
+    image src;                  // the file being sent
+    size_t offset;              // source bytes framed so far
+    size_t block_size;          // YM_BLOCK or YM_BLOCK_1K for file data
+    ym_block blocks[2];         // the packet in flight, and the one to send after it
+    ym_block *packet;           // the packet in flight
+    ym_block *next;             // framed ahead of the ACK for the packet in flight
+    int next_ready;             // next holds a framed packet
+    int next_state;             // YMODEM_FILEDATA, or YMODEM_EOT once the source is exhausted
+    uint8_t next_seqno;         // sequence number for the next data block
+    size_t packet_idx;          // index into the packet data
+    int cans;                   // CAN count
+    int completed;              // the batch ran through to the final ACK
+    int streaming;              // YModem-G: the receiver asked with 'G', no per-block ACKs
+    long baud;                  // line rate, for the time a packet spends on the wire
+    double deadline;            // when the wait in progress runs out, 0 if not waiting
+    int retries;                // times the packet in flight has been sent again
+    uint64_t acked_tx;          // wire_tx at the last response; everything after it crosses the line first
+    unsigned rtt_count;         // round trips timed so far
+    double srtt;                // smoothed receiver turnaround, wire time excluded
+    double rttvar;              // mean deviation of the turnaround
+    double turn_sum;            // for the mean turnaround in the summary
+    int drain;                  // wait for each packet to leave the tty before timing its ACK
+    xfer_stats stats;           // telemetry for the whole batch
+    char *json_path;            // where to write the JSON summary, or NULL
+    struct capture *capture;    // copy of what goes out on the line, or NULL
+} ymodem_state;
+
+// attempt to open a batch of files for ymodem transmit, returns 1 if successful
+int ymodem_open(ymodem_state *state, char **filenames, int count, size_t block_size, long baud, const char *json_path);
+// print the summary and turnaround, write the JSON if asked for, and free the files and blocks
+void ymodem_close(ymodem_state *state);
+// returns 0 if the ymodem transfer is over
+int ymodem_input(ymodem_state *state, uint8_t input);
+// the deadline has passed: resend the packet in flight, or cancel once the receiver has gone quiet
+void ymodem_timeout(ymodem_state *state);
+// returns 1 if there is output the tty couldn't take yet; the transfer is over once state is YMODEM_DONE
+int ymodem_output(ymodem_state *state, int fd);
+
+#endif
@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trs20.h"
+#include "capture.h"
+#include "yreceive.h"
+
+static const char *const yreceive_state_names[] = {
+    "wait_block0", "data", "done",
+};
+
+static void *yreceive_writer(void *arg)
+{
+    yreceive_state *state = arg;
+    uint8_t data[YM_BLOCK_1K];
+
+    for (;;) {
+        size_t head, tail;
+        int pending = ring_pending(&state->ring, &head, &tail);
+        if (pending < 0) break;
+        if (!pending) {
+            ring_nap(YR_IDLE_USEC);
+            continue;
+        }
+
+        while (head != tail) {
+            int32_t record[2];
+            ring_read(&state->ring, head, record, YR_RECORD);
+            if (record[1] == 0) {
+                close(record[0]);
+            } else {
+                ring_read(&state->ring, head + YR_RECORD, data, record[1]);
+                for (size_t done = 0; done < (size_t)record[1]; ) {
+                    ssize_t written = write(record[0], data + done, record[1] - done);
+                    if (written < 0 && errno == EINTR) continue;
+                    if (written <= 0) {
+                        state->disk_errors++;
+                        break;
+                    }
+                    done += written;
+                    state->disk_bytes += written;
+                }
+            }
+            head += YR_RECORD + record[1];
+            // hand each record's room back at once, the loop may be holding an ACK for it
+            ring_consumed(&state->ring, head);
+        }
+    }
+    return NULL;
+}
+
+// queue a record for the writer, size 0 closing fd; returns 0 if the ring has no room for it
+static int yreceive_queue(yreceive_state *state, int fd, const uint8_t *data, size_t size, size_t reserve)
+{
+    size_t tail;
+    size_t room = ring_room(&state->ring, &tail);
+    if (room < YR_RECORD + size + reserve) return 0;
+
+    int32_t record[2] = { fd, (int32_t)size };
+    ring_write(&state->ring, tail, record, YR_RECORD);
+    ring_write(&state->ring, tail + YR_RECORD, data, size);
+    ring_publish(&state->ring, tail + YR_RECORD + size);
+    size_t used = YR_RING - room + YR_RECORD + size;
+    if (used > state->ring_peak) state->ring_peak = used;
+    return 1;
+}
+
+// data blocks leave room for a close record, so closing a file never has to wait on the disk
+static void yreceive_close_file(yreceive_state *state)
+{
+    if (state->fd < 0) return;
+    yreceive_queue(state, state->fd, NULL, 0, 0);
+    state->fd = -1;
+}
+
+// queue a reply behind any the tty hasn't taken yet; a C or NAK still waiting is stale by then and goes
+static void yreceive_reply(yreceive_state *state, uint8_t first, uint8_t second)
+{
+    size_t keep = 0;
+    for (size_t i = 0; i < state->reply_len; i++) {
+        if (state->reply[i] != 'C' && state->reply[i] != 0x15) state->reply[keep++] = state->reply[i];
+    }
+    state->reply_len = keep;
+    // ACKs the line still hasn't taken: this one waits for the sender to ask again
+    if (state->reply_len + 2 > sizeof(state->reply)) return;
+    state->reply[state->reply_len++] = first;
+    if (second) state->reply[state->reply_len++] = second;
+}
+
+static void yreceive_cancel(yreceive_state *state, const char *why)
+{
+    printf("\n%s, cancelling\n", why);
+    state->reply_len = 0;
+    state->acking = 0;
+    yreceive_reply(state, 0x18, 0x18);
+    state->state = YRECEIVE_DONE;
+}
+
+// a bad block or a wait that ran out: ask again, or give up once it keeps happening
+static void yreceive_error(yreceive_state *state, const char *why)
+{
+    if (++state->errors > YR_MAX_ERRORS) {
+        yreceive_cancel(state, why);
+        return;
+    }
+    state->stats.naks++;
+    yreceive_reply(state, 0x15, 0);
+}
+
+// block 0 names the next file, or is empty to end the batch
+static void yreceive_header(yreceive_state *state)
+{
+    const char *payload = (const char *)state->packet.payload;
+    size_t size = state->packet_need - 5;
+    if (payload[0] == 0) {
+        yreceive_reply(state, 6, 0);
+        state->completed = 1;
+        state->state = YRECEIVE_DONE;
+        return;
+    }
+
+    // only the last path component, and never one that leaves the directory
+    char name[YM_BLOCK_1K + 1];
+    memcpy(name, payload, size);
+    name[size] = 0;
+    char *base = basename(name);
+    if (strcmp(base, ".") == 0 || strcmp(base, "..") == 0 || strcmp(base, "/") == 0) {
+        yreceive_cancel(state, "sender gave no usable file name");
+        return;
+    }
+    snprintf(state->name, sizeof(state->name), "%s", base);
+
+    size_t namelen = strlen(payload);
+    state->size = -1;
+    if (namelen + 1 < size) {
+        char *end;
+        long long length = strtoll(payload + namelen + 1, &end, 10);
+        if (end != payload + namelen + 1 && length >= 0) state->size = length;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", state->dir, state->name);
+    state->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (state->fd < 0) {
+        perror(path);
+        yreceive_cancel(state, "can't create the file");
+        return;
+    }
+    if (state->size >= 0) {
+        state->stats.total += state->size;
+        printf("%s: %lld bytes\n", path, (long long)state->size);
+    } else {
+        printf("%s: length not given\n", path);
+    }
+    state->queued = 0;
+    state->expect_seq = 1;
+    state->state = YRECEIVE_DATA;
+    yreceive_reply(state, 6, 'C');
+}
+
+// queue a verified data block and ACK it, or hold both until the writer has made room
+static void yreceive_deliver(yreceive_state *state)
+{
+    size_t count = state->packet_need - 5;
+    if (state->size >= 0) {
+        // the last block is padded out past the file's length
+        uint64_t remain = state->size - state->queued;
+        if (remain < count) count = remain;
+    }
+    if (count && !yreceive_queue(state, state->fd, state->packet.payload, count, YR_RECORD)) {
+        if (!state->block_held) state->disk_waits++;
+        state->block_held = 1;
+        state->deadline = stats_now() + YR_DISK_RETRY;
+        return;
+    }
+
+    state->block_held = 0;
+    state->queued += count;
+    state->stats.blocks++;
+    state->expect_seq++;
+    state->ack_payload = count;
+    state->acking = 1;
+    yreceive_reply(state, 6, 0);
+    state->deadline = stats_now() + YR_POLL;
+}
+
+// a whole block is in: check it, then take it or ask for it again
+static void yreceive_block(yreceive_state *state)
+{
+    size_t size = state->packet_need - 5;
+    uint16_t sum = crc(state->packet.payload, size);
+    if ((uint8_t)~state->packet.seqno != state->packet.seqcpl ||
+        state->packet.payload[size] != (sum >> 8) || state->packet.payload[size + 1] != (sum & 0xff)) {
+        yreceive_error(state, "too many bad blocks");
+        return;
+    }
+    state->errors = 0;
+    uint8_t seqno = state->packet.seqno;
+
+    if (state->state == YRECEIVE_WAIT_BLOCK0) {
+        if (seqno == 0) {
+            yreceive_header(state);
+        } else {
+            // a stale resend of the file just closed: ACK it so the sender moves on
+            yreceive_reply(state, 6, 0);
+        }
+        return;
+    }
+
+    if (seqno == state->expect_seq) {
+        stats_sent(&state->stats);
+        yreceive_deliver(state);
+    } else if (seqno == (uint8_t)(state->expect_seq - 1)) {
+        // the sender missed our ACK and sent it again; block 0 wants its C as well
+        yreceive_reply(state, 6, seqno == 0 && state->expect_seq == 1 ? 'C' : 0);
+    } else {
+        yreceive_cancel(state, "block out of sequence");
+    }
+}
+
+static int yreceive_step(yreceive_state *state, uint8_t input)
+{
+    if (state->packet_need) {
+        ((uint8_t *)&state->packet)[state->packet_len++] = input;
+        if (state->packet_len == state->packet_need) {
+            yreceive_block(state);
+            if (!state->block_held) state->packet_need = 0;
+        }
+        return 1;
+    }
+
+    // between blocks: a CAN pair from the sender ends it all
+    if (input == 0x18) {
+        state->stats.cans++;
+        if (++state->cans >= 2) {
+            printf("\nsender cancelled\n");
+            state->state = YRECEIVE_DONE;
+            return 0;
+        }
+        return 1;
+    }
+    state->cans = 0;
+
+    switch (input) {
+        case YM_SOH:
+        case YM_STX:
+            state->packet.type = input;
+            state->packet_len = 1;
+            state->packet_need = 3 + (input == YM_STX ? YM_BLOCK_1K : YM_BLOCK) + 2;
+            state->deadline = stats_now() + YR_POLL;
+            break;
+        case 4:
+            // EOT: the file is all here, or this is a resend because our ACK was lost
+            if (state->state == YRECEIVE_DATA) {
+                if (state->size >= 0 && state->queued != (uint64_t)state->size) {
+                    printf("\n%s: %llu of %lld bytes\n", state->name, (unsigned long long)state->queued,
+                           (long long)state->size);
+                }
+                yreceive_close_file(state);
+                state->files++;
+                state->state = YRECEIVE_WAIT_BLOCK0;
+            }
+            yreceive_reply(state, 6, 'C');
+            state->deadline = stats_now() + YR_POLL;
+            break;
+        default:
+            // line noise, or the rest of a block resent while we held its ACK
+            break;
+    }
+    return 1;
+}
+
+int yreceive_input(yreceive_state *state, uint8_t input)
+{
+    state->stats.wire_rx++;
+    // a held block keeps the parser where it is; the sender is waiting on its ACK anyway
+    if (state->block_held || state->state == YRECEIVE_DONE) return 1;
+    int running = yreceive_step(state, input);
+    stats_state(&state->stats, state->state);
+    return running;
+}
+
+void yreceive_timeout(yreceive_state *state)
+{
+    // a block that started or went to the ring since the timer was armed has pushed the wait back
+    if (!stats_expired(state->deadline)) return;
+
+    if (state->block_held) {
+        yreceive_deliver(state);
+        if (!state->block_held) state->packet_need = 0;
+        return;
+    }
+
+    state->stats.timeouts++;
+    state->packet_need = 0;
+    state->deadline = stats_now() + YR_POLL;
+    if (state->state == YRECEIVE_WAIT_BLOCK0 && state->files == 0) {
+        // nothing from the sender yet: keep asking for a CRC batch
+        if (++state->errors > YR_START_POLLS) {
+            yreceive_cancel(state, "no sender");
+        } else {
+            yreceive_reply(state, 'C', 0);
+        }
+    } else if (state->state == YRECEIVE_WAIT_BLOCK0) {
+        if (++state->errors > YR_MAX_ERRORS) {
+            yreceive_cancel(state, "sender timed out");
+        } else {
+            yreceive_reply(state, 'C', 0);
+        }
+    } else {
+        yreceive_error(state, "sender timed out");
+    }
+    stats_state(&state->stats, state->state);
+}
+
+int yreceive_output(yreceive_state *state, int fd)
+{
+    if (state->reply_len == 0) return 0;
+
+    ssize_t sent = write(fd, state->reply, state->reply_len);
+    if (sent <= 0) return 1;
+    state->stats.wire_tx += sent;
+    if (state->capture) capture_put(state->capture, CAPTURE_TX, state->reply, sent);
+    state->reply_len -= sent;
+    memmove(state->reply, state->reply + sent, state->reply_len);
+    if (state->reply_len) return 1;
+
+    if (state->acking) {
+        // the block's ACK is on its way: time it from the block's last byte
+        stats_acked(&state->stats, state->ack_payload);
+        stats_progress(&state->stats);
+        state->acking = 0;
+    }
+    if (state->state == YRECEIVE_DONE) state->deadline = 0;
+    return 0;
+}
+
+int yreceive_open(yreceive_state *state, const char *dir, const char *json_path)
+{
+    struct stat dirstat;
+    if (stat(dir, &dirstat) != 0) {
+        perror(dir);
+        return 0;
+    }
+    if (!S_ISDIR(dirstat.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", dir);
+        return 0;
+    }
+
+    int progress = state->stats.progress;
+    memset(state, 0, sizeof(yreceive_state));
+    state->stats.progress = progress;
+    if (!ring_open(&state->ring, YR_RING)) {
+        perror("can't allocate the disk ring");
+        return 0;
+    }
+    if (pthread_create(&state->writer, NULL, yreceive_writer, state) != 0) {
+        perror("can't start disk writer");
+        ring_close(&state->ring);
+        return 0;
+    }
+    state->dir = strdup(dir);
+    state->json_path = json_path ? strdup(json_path) : NULL;
+    state->fd = -1;
+    state->state = YRECEIVE_WAIT_BLOCK0;
+    stats_start(&state->stats, YRECEIVE_WAIT_BLOCK0, 0);
+    yreceive_reply(state, 'C', 0);
+    state->deadline = stats_now() + YR_POLL;
+    return 1;
+}
+
+void yreceive_close(yreceive_state *state)
+{
+    stats_finish(&state->stats, YRECEIVE_DONE);
+    if (state->fd >= 0) {
+        printf("%s: incomplete, %llu bytes kept\n", state->name, (unsigned long long)state->queued);
+        yreceive_close_file(state);
+    }
+
+    // the last blocks can still be on their way to disk
+    ring_stop(&state->ring);
+    pthread_join(state->writer, NULL);
+    double drained = stats_now() - state->stats.end;
+    if (state->disk_errors) state->completed = 0;
+
+    printf("%d file%s received\n", state->files, state->files == 1 ? "" : "s");
+    stats_report(&state->stats, stdout);
+    printf("disk: %llu bytes written, %.1fms after the last ACK, ring peak %zu KB, %u ACKs waited for room%s\n",
+           (unsigned long long)state->disk_bytes, drained * 1e3, state->ring_peak / 1024, state->disk_waits,
+           state->disk_errors ? ", WRITE ERRORS" : "");
+    if (state->json_path) {
+        stats_json(&state->stats, state->json_path, "ymodem-rx",
+                   yreceive_state_names, sizeof(yreceive_state_names) / sizeof(yreceive_state_names[0]));
+    }
+
+    ring_close(&state->ring);
+    free(state->dir);
+    free(state->json_path);
+    state->dir = NULL;
+    state->json_path = NULL;
+}
@@ -0,0 +1,78 @@
+#ifndef YRECEIVE_H
+#define YRECEIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "ring.h"
+#include "ymodem.h"
+
+/*
+ * The receiving side of YModem and YModem-1K. Verified blocks go to a
+ * single-producer single-consumer ring, and a writer thread takes them from
+ * there to disk, so a block is ACKed as soon as its CRC checks out whatever
+ * the disk is doing. Only a full ring holds an ACK back, until the writer
+ * has made room for the block.
+ */
+
+#define YRECEIVE_WAIT_BLOCK0    0               // polling with C for a file header, or the empty one that ends the batch
+#define YRECEIVE_DATA           1               // taking the file's data blocks
+#define YRECEIVE_DONE           2               // batch over, or cancelled
+
+#define YR_RING                 (1 << 20)       // write-behind bytes, a power of two
+#define YR_RECORD               8               // ring record header: 4-byte fd, 4-byte length, 0 to close the fd
+#define YR_IDLE_USEC            1000            // writer's nap when the ring is empty
+#define YR_POLL                 3.0             // seconds between C's, and the wait for the rest of a block
+#define YR_START_POLLS          20              // C's sent for the first header before giving up
+#define YR_MAX_ERRORS           10              // bad blocks or timeouts in a row before cancelling
+#define YR_DISK_RETRY           0.001           // seconds before trying again to queue a block the ring had no room for
+
+typedef struct yreceive_state
+{
+    int state;                  // YRECEIVE_XXX constant
+    char *dir;                  // where received files go
+    int fd;                     // the file being received, -1 between files
+    char name[256];             // and its name
+    int64_t size;               // its length from block 0, -1 if the sender didn't give one
+    uint64_t queued;            // file bytes queued for it so far
+    int files;                  // files received
+    uint8_t expect_seq;         // sequence number of the next data block
+    ym_packet packet;           // block being read
+    size_t packet_len;          // bytes of it so far
+    size_t packet_need;         // bytes in the whole block, 0 between blocks
+    int block_held;             // a verified block is waiting for room in the ring, and its ACK with it
+    uint8_t reply[4];           // C, ACK, NAK or CANs waiting to go out
+    size_t reply_len;
+    uint64_t ack_payload;       // file bytes the queued ACK accepts, for the stats
+    int acking;                 // the reply holds the ACK for a data block
+    int errors;                 // bad blocks or timeouts in a row
+    int cans;                   // consecutive CANs between blocks
+    int completed;              // the batch ran through to its empty block 0
+    double deadline;            // when the wait for a block runs out, or the ring is tried again
+    xfer_stats stats;           // telemetry for the whole batch; naks counts the ones sent
+    char *json_path;            // where to write the JSON summary, or NULL
+    struct capture *capture;    // copy of what goes out on the line, or NULL
+
+    // write-behind: the loop queues verified data, the writer thread puts it on disk
+    ring ring;
+    pthread_t writer;
+    uint64_t disk_bytes;        // written by the writer, read once it has exited
+    unsigned disk_errors;
+    size_t ring_peak;           // most the ring has held
+    unsigned disk_waits;        // ACKs held back for room in the ring
+} yreceive_state;
+
+// start receiving a YModem batch into dir, returns 1 if successful
+int yreceive_open(yreceive_state *state, const char *dir, const char *json_path);
+// wait for the writer to put everything on disk, then report the transfer
+void yreceive_close(yreceive_state *state);
+// returns 0 if the sender cancelled the transfer
+int yreceive_input(yreceive_state *state, uint8_t input);
+// the wait for a block ran out, or it's time to try the ring again
+void yreceive_timeout(yreceive_state *state);
+// returns 1 if there is output the tty couldn't take yet; the transfer is over once it's all out in YRECEIVE_DONE
+int yreceive_output(yreceive_state *state, int fd);
+
+#endif
@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "trs20.h"
+#include "image.h"
+#include "capture.h"
+#include "zmodem.h"
+
+#define ZPAD                    '*'             // header lead-in
+#define ZDLE                    0x18            // escape, also CAN
+#define ZBIN                    'A'             // binary header, CRC-16
+#define ZHEX                    'B'             // hex header, CRC-16
+#define ZBIN32                  'C'             // binary header, CRC-32
+
+#define ZRQINIT                 0               // frame types
+#define ZRINIT                  1
+#define ZACK                    3
+#define ZFILE                   4
+#define ZSKIP                   5
+#define ZNAK                    6
+#define ZABORT                  7
+#define ZFIN                    8
+#define ZRPOS                   9
+#define ZDATA                   10
+#define ZEOF                    11
+#define ZFERR                   12
+#define ZCRC                    13
+#define ZCAN                    16
+
+#define ZCRCE                   'h'             // subpacket ends the frame, a header follows
+#define ZCRCG                   'i'             // frame goes on, no answer wanted
+#define ZCRCQ                   'j'             // frame goes on, ZACK wanted
+#define ZCRCW                   'k'             // frame ends, wait for ZACK
+#define ZRUB0                   'l'             // escaped 0x7f
+#define ZRUB1                   'm'             // escaped 0xff
+
+#define CANFC32                 0x20            // ZRINIT ZF0: receiver takes 32-bit CRCs
+#define ESCCTL                  0x40            // ZRINIT ZF0: receiver wants control characters escaped
+#define ZCBIN                   1               // ZFILE ZF0: binary transfer
+#define ZCRESUM                 3               // ZFILE ZF0: resume an interrupted transfer
+
+#define ZRX_IDLE                0               // header parser: looking for ZPAD
+#define ZRX_PAD                 1               // seen ZPAD
+#define ZRX_DLE                 2               // seen ZPAD ZDLE, the header kind is next
+#define ZRX_BODY                3               // reading the header
+
+#define ZM_TURN                 1.0             // receiver turnaround allowed on top of draining the tty, in seconds
+#define ZM_MAX_RETRIES          10              // timeouts or error restarts in a row before the transfer is cancelled
+#define ZM_QUERY_INTERVAL       8192            // bytes between ZCRCQ subpackets, which the receiver ZACKs
+#define ZM_GROW_AFTER           32              // clean subpackets before a shrunk subpacket size doubles again
+
+static const char *const zmodem_state_names[] = {
+    "init", "wait_rinit", "file", "wait_rpos", "data", "wait_ack",
+    "eof", "wait_eof", "fin", "wait_fin", "oo", "cancel", "done",
+};
+
+static const char hex[] = "0123456789abcdef";
+
+static void zm_raw(zmodem_state *state, uint8_t byte)
+{
+    state->frame[state->frame_len++] = byte;
+}
+
+// ZDLE and the flow control characters always go escaped, and every control character if the receiver asks
+static void zm_escaped(zmodem_state *state, uint8_t byte)
+{
+    int escape;
+    switch (byte) {
+        case ZDLE:
+        case 0x10:
+        case 0x11:
+        case 0x13:
+        case 0x90:
+        case 0x91:
+        case 0x93:
+            escape = 1;
+            break;
+        default:
+            escape = state->escape_ctl && (byte & 0x60) == 0;
+            break;
+    }
+    if (escape) {
+        zm_raw(state, ZDLE);
+        zm_raw(state, byte ^ 0x40);
+    } else {
+        zm_raw(state, byte);
+    }
+}
+
+// frame a hex header, which the receiver can read whatever it has negotiated
+static void zm_hex_header(zmodem_state *state, int type, uint32_t pos)
+{
+    uint8_t header[5] = { type, pos, pos >> 8, pos >> 16, pos >> 24 };
+    uint16_t sum = crc_update(0, header, 5);
+    uint8_t check[2] = { sum >> 8, sum & 0xff };
+
+    zm_raw(state, ZPAD);
+    zm_raw(state, ZPAD);
+    zm_raw(state, ZDLE);
+    zm_raw(state, ZHEX);
+    for (int i = 0; i < 7; i++) {
+        uint8_t byte = i < 5 ? header[i] : check[i - 5];
+        zm_raw(state, hex[byte >> 4]);
+        zm_raw(state, hex[byte & 0xf]);
+    }
+    zm_raw(state, '\r');
+    zm_raw(state, 0x8a);
+    if (type != ZFIN && type != ZACK) zm_raw(state, 0x11);
+}
+
+// frame a binary header, with a 32-bit CRC if the receiver takes them
+static void zm_bin_header(zmodem_state *state, int type, uint32_t pos)
+{
+    uint8_t header[5] = { type, pos, pos >> 8, pos >> 16, pos >> 24 };
+
+    zm_raw(state, ZPAD);
+    zm_raw(state, ZDLE);
+    zm_raw(state, state->crc32 ? ZBIN32 : ZBIN);
+    for (int i = 0; i < 5; i++) {
+        zm_escaped(state, header[i]);
+    }
+    if (state->crc32) {
+        uint32_t sum = crc32(0, header, 5);
+        for (int i = 0; i < 4; i++) {
+            zm_escaped(state, sum >> (8 * i));
+        }
+    } else {
+        uint16_t sum = crc_update(0, header, 5);
+        zm_escaped(state, sum >> 8);
+        zm_escaped(state, sum & 0xff);
+    }
+}
+
+// frame a data subpacket; the CRC covers the data and the end byte
+static void zm_subpacket(zmodem_state *state, const uint8_t *data, size_t len, uint8_t end)
+{
+    for (size_t i = 0; i < len; i++) {
+        zm_escaped(state, data[i]);
+    }
+    zm_raw(state, ZDLE);
+    zm_raw(state, end);
+    if (state->crc32) {
+        uint32_t sum = crc32(crc32(0, data, len), &end, 1);
+        for (int i = 0; i < 4; i++) {
+            zm_escaped(state, sum >> (8 * i));
+        }
+    } else {
+        uint16_t sum = crc_update(crc_update(0, data, len), &end, 1);
+        zm_escaped(state, sum >> 8);
+        zm_escaped(state, sum & 0xff);
+    }
+}
+
+// load the current file of the batch
+static int zmodem_start_file(zmodem_state *state)
+{
+    char *filename = state->files[state->file_idx];
+    struct stat filestat;
+    if (!image_load(&state->src, filename, &filestat)) {
+        return 0;
+    }
+    state->mtime = filestat.st_mtime;
+    state->offset = 0;
+    state->acked = 0;
+    printf("%s: %zu bytes, %d of %d\n", filename, state->src.size, state->file_idx + 1, state->file_count);
+    return 1;
+}
+
+// the receiver has the file (or skipped it): on to the next one, or ZFIN after the last
+static void zmodem_next_file(zmodem_state *state)
+{
+    state->batch_left -= state->src.size;
+    image_unload(&state->src);
+    state->state = ZMODEM_FIN;
+    while (++state->file_idx < state->file_count) {
+        if (zmodem_start_file(state)) {
+            state->state = ZMODEM_FILE;
+            break;
+        }
+    }
+}
+
+// the receiver confirmed everything before pos
+static void zmodem_acked(zmodem_state *state, size_t pos)
+{
+    size_t delta = pos > state->acked && pos <= state->src.size ? pos - state->acked : 0;
+    if (delta) state->acked = pos;
+    stats_acked(&state->stats, delta);
+    stats_progress(&state->stats);
+}
+
+// send the last frame again from `resend`, or give up after ZM_MAX_RETRIES
+static void zmodem_retry(zmodem_state *state, int resend)
+{
+    if (++state->retries > ZM_MAX_RETRIES) {
+        printf("\nno progress after %d retries, cancelling\n", ZM_MAX_RETRIES);
+        state->frame_len = state->frame_idx = 0;
+        state->state = ZMODEM_CANCEL;
+    } else {
+        state->state = resend;
+    }
+}
+
+static void zmodem_header(zmodem_state *state, int type, uint32_t pos)
+{
+    uint8_t flags = pos >> 24;
+
+    switch (type) {
+        case ZRINIT:
+            if (state->state == ZMODEM_INIT || state->state == ZMODEM_WAIT_RINIT) {
+                state->crc32 = (flags & CANFC32) != 0;
+                state->escape_ctl = (flags & ESCCTL) != 0;
+                state->rx_buffer = pos & 0xffff;
+                state->retries = 0;
+                state->state = ZMODEM_FILE;
+            } else if (state->state == ZMODEM_WAIT_EOF) {
+                zmodem_acked(state, state->src.size);
+                state->retries = 0;
+                zmodem_next_file(state);
+            }
+            break;
+        case ZRPOS:
+            if (pos > state->src.size) break;
+            if (state->state == ZMODEM_WAIT_RPOS) {
+                if (pos > 0) {
+                    printf("resuming at byte %u\n", pos);
+                    state->stats.total -= pos;
+                }
+                state->offset = state->acked = pos;
+                state->retries = 0;
+                state->zdata = 1;
+                state->state = ZMODEM_DATA;
+            } else if (state->state >= ZMODEM_DATA && state->state <= ZMODEM_WAIT_EOF) {
+                // the receiver lost something: drop what's queued, go back to pos, with smaller subpackets
+                state->stats.naks++;
+                state->stats.retransmits++;
+                if (pos > state->acked) {
+                    zmodem_acked(state, pos);
+                    state->retries = 0;
+                }
+                if (state->subpacket > ZM_SUBPACKET_MIN) state->subpacket /= 2;
+                state->clean = 0;
+                state->offset = pos;
+                state->frame_len = state->frame_idx = 0;
+                state->purge = 1;
+                state->zdata = 1;
+                zmodem_retry(state, ZMODEM_DATA);
+            }
+            break;
+        case ZACK:
+            if (state->state == ZMODEM_DATA || state->state == ZMODEM_WAIT_ACK) {
+                zmodem_acked(state, pos);
+                state->retries = 0;
+                if (state->state == ZMODEM_WAIT_ACK) {
+                    state->zdata = 1;
+                    state->state = ZMODEM_DATA;
+                }
+            }
+            break;
+        case ZSKIP:
+            if (state->state == ZMODEM_WAIT_RPOS) {
+                printf("%s: skipped by the receiver\n", state->files[state->file_idx]);
+                state->stats.total -= state->src.size;
+                zmodem_next_file(state);
+            }
+            break;
+        case ZNAK:
+            // the receiver garbled a header: send it again
+            if (state->state == ZMODEM_WAIT_RINIT) zmodem_retry(state, ZMODEM_INIT);
+            if (state->state == ZMODEM_WAIT_RPOS) zmodem_retry(state, ZMODEM_FILE);
+            if (state->state == ZMODEM_WAIT_EOF) zmodem_retry(state, ZMODEM_EOF);
+            if (state->state == ZMODEM_WAIT_FIN) zmodem_retry(state, ZMODEM_FIN);
+            break;
+        case ZCRC:
+            // the receiver wants the file's CRC to check the copy it already has
+            if (state->state == ZMODEM_WAIT_RPOS) {
+                zm_hex_header(state, ZCRC, crc32(0, state->src.data, state->src.size));
+            }
+            break;
+        case ZFIN:
+            if (state->state == ZMODEM_WAIT_FIN) {
+                state->completed = 1;
+                state->state = ZMODEM_OO;
+            }
+            break;
+        case ZABORT:
+        case ZFERR:
+        case ZCAN:
+            printf("\nreceiver aborted the transfer\n");
+            state->frame_len = state->frame_idx = 0;
+            state->state = ZMODEM_CANCEL;
+            break;
+    }
+}
+
+static int hex_value(uint8_t c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static int zmodem_step(zmodem_state *state, uint8_t input)
+{
+    // five CANs in a row is the receiver's abort sequence
+    if (input == ZDLE) {
+        if (++state->cans >= 5) {
+            state->stats.cans += state->cans;
+            return 0;
+        }
+    } else {
+        state->cans = 0;
+    }
+
+    switch (state->rx_state) {
+        case ZRX_IDLE:
+            if (input == ZPAD) state->rx_state = ZRX_PAD;
+            break;
+        case ZRX_PAD:
+            if (input == ZDLE) {
+                state->rx_state = ZRX_DLE;
+            } else if (input != ZPAD) {
+                state->rx_state = ZRX_IDLE;
+            }
+            break;
+        case ZRX_DLE:
+            state->rx_kind = input;
+            state->rx_len = 0;
+            state->rx_escape = 0;
+            state->rx_need = input == ZHEX ? 14 : input == ZBIN ? 7 : 9;
+            state->rx_state = input == ZHEX || input == ZBIN || input == ZBIN32 ? ZRX_BODY : ZRX_IDLE;
+            break;
+        case ZRX_BODY:
+            if (state->rx_kind == ZHEX) {
+                int v = hex_value(input & 0x7f);
+                if (v < 0) {
+                    state->rx_state = ZRX_IDLE;
+                    break;
+                }
+                uint8_t *b = &state->rx_buf[state->rx_len / 2];
+                *b = state->rx_len % 2 ? (*b << 4) | v : v;
+            } else if (state->rx_escape) {
+                state->rx_escape = 0;
+                state->rx_buf[state->rx_len] = input == ZRUB0 ? 0x7f : input == ZRUB1 ? 0xff : input ^ 0x40;
+            } else if (input == ZDLE) {
+                state->rx_escape = 1;
+                break;
+            } else {
+                state->rx_buf[state->rx_len] = input;
+            }
+            if (++state->rx_len < state->rx_need) break;
+
+            state->rx_state = ZRX_IDLE;
+            uint8_t *b = state->rx_buf;
+            int good;
+            if (state->rx_kind == ZBIN32) {
+                uint32_t sum = b[5] | b[6] << 8 | b[7] << 16 | (uint32_t)b[8] << 24;
+                good = crc32(0, b, 5) == sum;
+            } else {
+                // a CRC-16 run over its own check bytes comes out as zero
+                good = crc_update(0, b, 7) == 0;
+            }
+            if (good) {
+                zmodem_header(state, b[0], b[1] | b[2] << 8 | b[3] << 16 | (uint32_t)b[4] << 24);
+            }
+            break;
+    }
+
+    return 1;
+}
+
+int zmodem_input(zmodem_state *state, uint8_t input)
+{
+    int entered = state->state;
+    state->stats.wire_rx++;
+    int running = zmodem_step(state, input);
+    if (state->state != entered) state->deadline = 0;
+    stats_state(&state->stats, state->state);
+    return running;
+}
+
+void zmodem_timeout(zmodem_state *state)
+{
+    // a header from the receiver since the timer was armed may have answered the wait and moved the deadline
+    if (!stats_expired(state->deadline)) return;
+
+    state->deadline = 0;
+    if (state->state == ZMODEM_DATA) return;        // the line has room for more
+    state->stats.timeouts++;
+    switch (state->state) {
+        case ZMODEM_WAIT_RINIT:
+            zmodem_retry(state, ZMODEM_INIT);
+            break;
+        case ZMODEM_WAIT_RPOS:
+            zmodem_retry(state, ZMODEM_FILE);
+            break;
+        case ZMODEM_WAIT_ACK:
+            // pick up again from what the receiver last confirmed
+            state->stats.retransmits++;
+            state->offset = state->acked;
+            state->zdata = 1;
+            zmodem_retry(state, ZMODEM_DATA);
+            break;
+        case ZMODEM_WAIT_EOF:
+            zmodem_retry(state, ZMODEM_EOF);
+            break;
+        case ZMODEM_WAIT_FIN:
+            zmodem_retry(state, ZMODEM_FIN);
+            break;
+    }
+    stats_state(&state->stats, state->state);
+}
+
+// frame the next data subpacket, opening a ZDATA frame first if one's due
+static void zmodem_data(zmodem_state *state)
+{
+    size_t size = state->src.size;
+    if (state->offset >= size) {
+        state->state = ZMODEM_EOF;
+        return;
+    }
+    if (state->zdata) {
+        zm_bin_header(state, ZDATA, state->offset);
+        state->window_start = state->offset;
+        state->zdata = 0;
+    }
+
+    size_t len = size - state->offset < state->subpacket ? size - state->offset : state->subpacket;
+    size_t end_offset = state->offset + len;
+    uint8_t end;
+    if (end_offset == size) {
+        end = ZCRCE;
+    } else if (state->rx_buffer && end_offset - state->window_start + state->subpacket > state->rx_buffer) {
+        // the receiver can't hold another subpacket: stop for it to catch up
+        end = ZCRCW;
+    } else if (end_offset / ZM_QUERY_INTERVAL != state->offset / ZM_QUERY_INTERVAL) {
+        end = ZCRCQ;
+    } else {
+        end = ZCRCG;
+    }
+
+    zm_subpacket(state, state->src.data + state->offset, len, end);
+    state->offset = end_offset;
+    state->stats.blocks++;
+    if (end == ZCRCQ || end == ZCRCW) stats_sent(&state->stats);
+    if (end == ZCRCW) state->state = ZMODEM_WAIT_ACK;
+    if (end == ZCRCE) state->state = ZMODEM_EOF;
+
+    if (++state->clean >= ZM_GROW_AFTER && state->subpacket < ZM_SUBPACKET) {
+        state->subpacket *= 2;
+        state->clean = 0;
+    }
+}
+
+// frame whatever the state calls for next
+static void zmodem_frame(zmodem_state *state)
+{
+    char info[512];
+    int namelen, len;
+
+    switch (state->state) {
+        case ZMODEM_INIT:
+            // rz on the command line starts the target's receiver, if it's at a prompt
+            zm_raw(state, 'r');
+            zm_raw(state, 'z');
+            zm_raw(state, '\r');
+            zm_hex_header(state, ZRQINIT, 0);
+            state->state = ZMODEM_WAIT_RINIT;
+            break;
+        case ZMODEM_FILE:
+            // name, NUL, then length, octal mtime, mode, serial, files and bytes left
+            namelen = snprintf(info, 256, "%s", basename(state->files[state->file_idx]));
+            if (namelen > 255) namelen = 255;
+            len = snprintf(info + namelen + 1, sizeof(info) - namelen - 1, "%zu %llo 0 0 %d %llu",
+                           state->src.size, (long long)state->mtime, state->file_count - state->file_idx,
+                           (unsigned long long)state->batch_left);
+            zm_bin_header(state, ZFILE, (uint32_t)(state->resume ? ZCRESUM : ZCBIN) << 24);
+            zm_subpacket(state, (uint8_t *)info, namelen + 1 + len + 1, ZCRCW);
+            stats_sent(&state->stats);
+            state->state = ZMODEM_WAIT_RPOS;
+            break;
+        case ZMODEM_DATA:
+            zmodem_data(state);
+            break;
+        case ZMODEM_EOF:
+            zm_bin_header(state, ZEOF, state->src.size);
+            stats_sent(&state->stats);
+            state->state = ZMODEM_WAIT_EOF;
+            break;
+        case ZMODEM_FIN:
+            zm_hex_header(state, ZFIN, 0);
+            state->state = ZMODEM_WAIT_FIN;
+            break;
+        case ZMODEM_OO:
+            zm_raw(state, 'O');
+            zm_raw(state, 'O');
+            state->state = ZMODEM_DONE;
+            break;
+        case ZMODEM_CANCEL:
+            for (int i = 0; i < 10; i++) zm_raw(state, 0x18);
+            for (int i = 0; i < 10; i++) zm_raw(state, 0x08);
+            state->state = ZMODEM_DONE;
+            break;
+    }
+}
+
+static int zmodem_write(zmodem_state *state, int fd)
+{
+    double now = stats_now();
+    if (state->purge) {
+        tcflush(fd, TCOFLUSH);
+        state->drain_at = now;
+        state->purge = 0;
+    }
+
+    for (;;) {
+        if (state->frame_idx < state->frame_len) {
+            ssize_t sent = write(fd, state->frame + state->frame_idx, state->frame_len - state->frame_idx);
+            if (sent > 0) {
+                if (state->capture) capture_put(state->capture, CAPTURE_TX, state->frame + state->frame_idx, sent);
+                state->stats.wire_tx += sent;
+                state->frame_idx += sent;
+                state->drain_at = (state->drain_at > now ? state->drain_at : now) + sent * 10.0 / state->baud;
+            }
+            if (state->frame_idx < state->frame_len) return 1;
+        }
+        state->frame_len = state->frame_idx = 0;
+
+        // keep no more than ZM_TX_WINDOW ahead of the line, so a ZRPOS throws little away
+        double ahead = ZM_TX_WINDOW * 10.0 / state->baud;
+        if (state->state == ZMODEM_DATA && state->drain_at - now > ahead) {
+            state->deadline = state->drain_at - ahead;
+            return 0;
+        }
+
+        // keep framing while there's something to send, and stop once waiting on the receiver
+        int before = state->state;
+        zmodem_frame(state);
+        if (state->frame_len == 0 && state->state == before) return 0;
+    }
+}
+
+int zmodem_output(zmodem_state *state, int fd)
+{
+    int entered = state->state;
+    int blocked = zmodem_write(state, fd);
+    if (state->state != entered) state->deadline = 0;
+
+    // a wait starts once its frame is out of our hands: allow for the line to drain, and the turnaround
+    int waiting = state->state == ZMODEM_WAIT_RINIT || state->state == ZMODEM_WAIT_RPOS ||
+                  state->state == ZMODEM_WAIT_ACK || state->state == ZMODEM_WAIT_EOF ||
+                  state->state == ZMODEM_WAIT_FIN;
+    if (waiting && !blocked && state->deadline == 0) {
+        double now = stats_now();
+        state->deadline = (state->drain_at > now ? state->drain_at : now) + ZM_TURN;
+    }
+
+    stats_state(&state->stats, state->state);
+    return blocked;
+}
+
+int zmodem_open(zmodem_state *state, char **filenames, int count, int resume, long baud, const char *json_path)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        struct stat filestat;
+        if (stat(filenames[i], &filestat) != 0) {
+            perror(filenames[i]);
+            return 0;
+        }
+        if (!S_ISREG(filestat.st_mode)) {
+            fprintf(stderr, "%s: not a regular file\n", filenames[i]);
+            return 0;
+        }
+        total += filestat.st_size;
+    }
+
+    memset(state, 0, sizeof(zmodem_state));
+    state->files = malloc(count * sizeof(char *));
+    for (int i = 0; i < count; i++) {
+        state->files[i] = strdup(filenames[i]);
+    }
+    state->file_count = count;
+    state->state = ZMODEM_INIT;
+    state->resume = resume;
+    state->subpacket = ZM_SUBPACKET;
+    state->batch_left = total;
+    state->baud = baud;
+    state->json_path = json_path ? strdup(json_path) : NULL;
+    state->stats.progress = 1;
+    stats_start(&state->stats, ZMODEM_INIT, total);
+
+    for (state->file_idx = 0; state->file_idx < count; state->file_idx++) {
+        if (zmodem_start_file(state)) {
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(state->files[i]);
+    }
+    free(state->files);
+    free(state->json_path);
+    return 0;
+}
+
+void zmodem_close(zmodem_state *state)
+{
+    stats_finish(&state->stats, state->state);
+    stats_report(&state->stats, stdout);
+    if (state->json_path) {
+        stats_json(&state->stats, state->json_path, "zmodem",
+                   zmodem_state_names, sizeof(zmodem_state_names) / sizeof(zmodem_state_names[0]));
+    }
+    image_unload(&state->src);
+    for (int i = 0; i < state->file_count; i++) {
+        free(state->files[i]);
+    }
+    free(state->files);
+    free(state->json_path);
+    state->files = NULL;
+    state->file_count = 0;
+    state->json_path = NULL;
+}
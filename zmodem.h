@@ -0,0 +1,81 @@
+#ifndef ZMODEM_H
+#define ZMODEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "image.h"
+#include "stats.h"
+
+#define ZMODEM_INIT             0               // sending rz and ZRQINIT
+#define ZMODEM_WAIT_RINIT       1               // waiting for ZRINIT
+#define ZMODEM_FILE             2               // sending ZFILE and the file information
+#define ZMODEM_WAIT_RPOS        3               // waiting for ZRPOS (or ZSKIP)
+#define ZMODEM_DATA             4               // streaming ZDATA subpackets
+#define ZMODEM_WAIT_ACK         5               // sent ZCRCW, waiting for ZACK
+#define ZMODEM_EOF              6               // sending ZEOF
+#define ZMODEM_WAIT_EOF         7               // waiting for ZRINIT after ZEOF
+#define ZMODEM_FIN              8               // sending ZFIN
+#define ZMODEM_WAIT_FIN         9               // waiting for the receiver's ZFIN
+#define ZMODEM_OO               10              // sending "OO", over and out
+#define ZMODEM_CANCEL           11              // sending the abort sequence
+#define ZMODEM_DONE             12              // transfer over
+
+#define ZM_SUBPACKET            1024            // largest data subpacket
+#define ZM_SUBPACKET_MIN        64              // smallest a noisy line pushes it down to
+#define ZM_TX_WINDOW            2048            // bytes let ahead of the line, all lost to a ZRPOS
+#define ZM_FRAME_MAX            (2 * ZM_SUBPACKET + 64)     // a subpacket with every byte escaped, plus header and CRC
+
+typedef struct zmodem_state
+{
+    int state;                  // ZMODEM_XXX constant
+    char **files;               // the batch, sent in order in one session
+    int file_count;
+    int file_idx;               // index of the file being sent
+    image src;                  // the file being sent
+    time_t mtime;               // its modification time, for the ZFILE information
+    uint64_t batch_left;        // bytes in this file and the ones after it
+    int resume;                 // ask the receiver to resume a partial file (ZCRESUM)
+    int crc32;                  // the receiver takes 32-bit CRCs, so binary frames use them
+    int escape_ctl;             // the receiver wants every control character escaped
+    size_t rx_buffer;           // the receiver's buffer size from ZRINIT, 0 if it can stream without stopping
+    size_t offset;              // next file byte to frame
+    size_t acked;               // file bytes the receiver has confirmed
+    size_t window_start;        // offset the ZDATA frame began at, for the rx_buffer limit
+    size_t subpacket;           // data bytes per subpacket, shrunk by errors and grown back by clean runs
+    unsigned clean;             // subpackets since the last error
+    int zdata;                  // the next subpacket opens a new ZDATA frame
+    int purge;                  // drop what the tty still holds before going on
+    double drain_at;            // when the line will have sent everything written so far
+    uint8_t frame[ZM_FRAME_MAX];            // escaped bytes waiting to go out
+    size_t frame_len;
+    size_t frame_idx;
+    int rx_state;               // header parser state
+    uint8_t rx_buf[16];         // header bytes so far, hex digits or binary
+    int rx_len;
+    int rx_need;
+    int rx_kind;                // 'A', 'B' or 'C': binary with CRC-16, hex, binary with CRC-32
+    int rx_escape;              // the last byte was ZDLE
+    int cans;                   // consecutive CANs, five abort
+    int completed;              // the batch ran through to ZFIN
+    long baud;                  // line rate, for the time what's queued takes to drain
+    double deadline;            // when the wait in progress runs out, or the line has room again; 0 if neither
+    int retries;                // times the current wait has run out, or the receiver asked again
+    xfer_stats stats;           // telemetry for the whole batch
+    char *json_path;            // where to write the JSON summary, or NULL
+    struct capture *capture;    // copy of what goes out on the line, or NULL
+} zmodem_state;
+
+// attempt to open a batch of files for zmodem transmit, returns 1 if successful
+int zmodem_open(zmodem_state *state, char **filenames, int count, int resume, long baud, const char *json_path);
+// print the summary, write the JSON if asked for, and unmap the image and free the file list
+void zmodem_close(zmodem_state *state);
+// returns 0 if the zmodem transfer is over
+int zmodem_input(zmodem_state *state, uint8_t input);
+// the deadline has passed: send the last frame again, or cancel once the receiver has gone quiet
+void zmodem_timeout(zmodem_state *state);
+// returns 1 if there is output the tty couldn't take yet; the transfer is over once state is ZMODEM_DONE
+int zmodem_output(zmodem_state *state, int fd);
+
+#endif